@@ -1,20 +1,73 @@
 // Game Boy Emulator - Complete Skeleton
 // Compile: g++ gameboy.cpp -I./SDL2/x86_64-w64-mingw32/include/SDL2 -L./SDL2/x86_64-w64-mingw32/lib -lmingw32 -lSDL2main -lSDL2 -o gameboy
 // Run: ./gameboy rom.gb
-
+// -DGB_HEADLESS builds without SDL (headless modes only), -DGB_LIBRARY also
+// leaves out main() so the C API can go into a shared library
+// -DGB_FUZZ builds the CPU differential fuzzer as a libFuzzer target
+// -DGB_INSTRUMENT counts every opcode, memory access and ROM bank executed
+// and prints a sorted report at exit (compiled out otherwise)
+// -DGB_LOG=mask compiles in the event log categories in `mask` (see
+// LogCategory), written with --log
+
+#ifdef GB_FUZZ
+#define GB_LIBRARY
+#endif
+
+#ifdef GB_LIBRARY
+#define GB_HEADLESS
+#endif
+
+#ifndef GB_HEADLESS
 #include <SDL.h>
+#endif
 #include <iostream>
 #include <fstream>
 #include <array>
 #include <vector>
 #include <cstdint>
 #include <cmath>
+#include <string>
+#include <cstdlib>
+#include <algorithm>
+#include <deque>
+#include <cstring>
+#include <type_traits>
+#include <chrono>
+#include <iterator>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <map>
+#include <unordered_map>
+#include <filesystem>
+#include <csignal>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GB_X86_SIMD 1
+#endif
 
 
 // Forward declarations
 class Memory;
 class APU;
-class CPU;
+template<class Bus> class BasicCPU;
+using CPU = BasicCPU<Memory>;  // The CPU on the real memory map
 class PPU;
 class Timer;
 
@@ -23,6 +76,63 @@ const int SCREEN_WIDTH = 160;
 const int SCREEN_HEIGHT = 144;
 const int SCALE = 4;
 
+// CPU clock in Hz (T-cycles per second)
+const int CPU_FREQUENCY = 4194304;
+
+// xxHash64 (https://github.com/Cyan4973/xxHash), used for frame hashes
+inline uint64_t xxhash64(const void* data, size_t len, uint64_t seed = 0) {
+    const uint64_t P1 = 0x9E3779B185EBCA87ull;
+    const uint64_t P2 = 0xC2B2AE3D27D4EB4Full;
+    const uint64_t P3 = 0x165667B19E3779F9ull;
+    const uint64_t P4 = 0x85EBCA77C2B2AE63ull;
+    const uint64_t P5 = 0x27D4EB2F165667C5ull;
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto round = [&](uint64_t acc, uint64_t input) { return rotl(acc + input * P2, 31) * P1; };
+    auto read64 = [](const uint8_t* p) { uint64_t v; std::memcpy(&v, p, 8); return v; };
+
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    const uint8_t* end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+        do {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        for (uint64_t v : {v1, v2, v3, v4}) {
+            h = (h ^ round(0, v)) * P1 + P4;
+        }
+    } else {
+        h = seed + P5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+    }
+    if (p + 4 <= end) {
+        uint32_t v;
+        std::memcpy(&v, p, 4);
+        h = rotl(h ^ (v * P1), 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h = rotl(h ^ (*p * P5), 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
 // Memory Map (simplified)
 // 0x0000-0x3FFF: ROM Bank 0
 // 0x4000-0x7FFF: ROM Bank 1+ (switchable)
@@ -39,79 +149,1083 @@ const int SCALE = 4;
 
 
 
+#ifdef GB_INSTRUMENT
+// Execution histograms for finding what to optimize. Each GameBoy fills its
+// own profile; they are merged into one report printed at exit.
+struct ExecutionProfile {
+    enum Region { ROM0, ROMX, VRAM, SRAM, WRAM, ECHO, OAM, UNUSABLE, IO, HRAM, IE, REGION_COUNT };
+    static const int MAX_BANKS = 512;
+
+    uint64_t opcode_count[256];
+    uint64_t opcode_ticks[256];
+    uint64_t cb_count[256];
+    uint64_t cb_ticks[256];
+    uint64_t region_reads[REGION_COUNT];
+    uint64_t region_writes[REGION_COUNT];
+    uint64_t bank_count[MAX_BANKS + 1];  // Last slot: code running from RAM
+
+    ExecutionProfile() { clear(); }
+
+    void clear() {
+        std::memset(this, 0, sizeof(*this));
+    }
+
+    // Host time in TSC ticks where available, nanoseconds otherwise
+    static uint64_t now() {
+#ifdef GB_X86_SIMD
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    static Region regionOf(uint16_t addr) {
+        if (addr < 0x4000) return ROM0;
+        if (addr < 0x8000) return ROMX;
+        if (addr < 0xA000) return VRAM;
+        if (addr < 0xC000) return SRAM;
+        if (addr < 0xE000) return WRAM;
+        if (addr < 0xFE00) return ECHO;
+        if (addr < 0xFEA0) return OAM;
+        if (addr < 0xFF00) return UNUSABLE;
+        if (addr < 0xFF80) return IO;
+        if (addr < 0xFFFF) return HRAM;
+        return IE;
+    }
+
+    void merge(const ExecutionProfile& other) {
+        for (int i = 0; i < 256; i++) {
+            opcode_count[i] += other.opcode_count[i];
+            opcode_ticks[i] += other.opcode_ticks[i];
+            cb_count[i] += other.cb_count[i];
+            cb_ticks[i] += other.cb_ticks[i];
+        }
+        for (int i = 0; i < REGION_COUNT; i++) {
+            region_reads[i] += other.region_reads[i];
+            region_writes[i] += other.region_writes[i];
+        }
+        for (int i = 0; i <= MAX_BANKS; i++) {
+            bank_count[i] += other.bank_count[i];
+        }
+    }
+
+    void report(std::ostream& out) const {
+        static const char* REGION_NAMES[REGION_COUNT] = {
+            "ROM0", "ROMX", "VRAM", "SRAM", "WRAM", "ECHO", "OAM", "UNUSABLE", "IO", "HRAM", "IE"
+        };
+
+        // Opcodes and CB opcodes in one table, indices 256+ are CB
+        uint64_t total_count = 0;
+        uint64_t total_ticks = 0;
+        std::vector<int> ops;
+        for (int i = 0; i < 512; i++) {
+            uint64_t count = i < 256 ? opcode_count[i] : cb_count[i - 256];
+            if (count) {
+                ops.push_back(i);
+            }
+        }
+        for (int i = 0; i < 256; i++) {
+            total_count += opcode_count[i];
+            total_ticks += opcode_ticks[i];
+        }
+        auto ticksOf = [&](int i) { return i < 256 ? opcode_ticks[i] : cb_ticks[i - 256]; };
+        auto countOf = [&](int i) { return i < 256 ? opcode_count[i] : cb_count[i - 256]; };
+        std::sort(ops.begin(), ops.end(), [&](int a, int b) { return ticksOf(a) > ticksOf(b); });
+
+        out << "\n=== OPCODES (by host time) ===" << std::endl;
+        out << total_count << " instructions, " << total_ticks << " host ticks" << std::endl;
+        out << "opcode   count  %count  ticks/op  %time" << std::endl;
+        char line[96];
+        for (int i : ops) {
+            // CB time is part of the 0xCB prefix total, so shares are only given for base opcodes
+            std::snprintf(line, sizeof(line), "%s%02X  %llu  %.2f  %.1f  %.2f",
+                          i < 256 ? "   " : "CB ", i & 0xFF, (unsigned long long)countOf(i),
+                          100.0 * countOf(i) / std::max<uint64_t>(1, total_count),
+                          (double)ticksOf(i) / countOf(i),
+                          100.0 * ticksOf(i) / std::max<uint64_t>(1, total_ticks));
+            out << line << std::endl;
+        }
+
+        out << "\n=== MEMORY REGIONS ===" << std::endl;
+        out << "region  reads  writes" << std::endl;
+        for (int i = 0; i < REGION_COUNT; i++) {
+            if (region_reads[i] || region_writes[i]) {
+                out << REGION_NAMES[i] << "  " << region_reads[i] << "  " << region_writes[i] << std::endl;
+            }
+        }
+
+        out << "\n=== ROM BANKS (instructions executed) ===" << std::endl;
+        std::vector<int> banks;
+        for (int i = 0; i <= MAX_BANKS; i++) {
+            if (bank_count[i]) {
+                banks.push_back(i);
+            }
+        }
+        std::sort(banks.begin(), banks.end(), [&](int a, int b) { return bank_count[a] > bank_count[b]; });
+        for (int bank : banks) {
+            if (bank == MAX_BANKS) {
+                out << "RAM";
+            } else {
+                out << "bank " << bank;
+            }
+            out << "  " << bank_count[bank] << "  "
+                << 100.0 * bank_count[bank] / std::max<uint64_t>(1, total_count) << "%" << std::endl;
+        }
+    }
+};
+
+// Process-wide totals, reported when the program exits
+struct ExecutionReport {
+    std::mutex mutex;
+    ExecutionProfile total;
+
+    ~ExecutionReport() {
+        total.report(std::cout);
+    }
+
+    static ExecutionReport& get() {
+        static ExecutionReport report;
+        return report;
+    }
+
+    void add(const ExecutionProfile& profile) {
+        std::lock_guard<std::mutex> lock(mutex);
+        total.merge(profile);
+    }
+};
+#endif // GB_INSTRUMENT
+
+// Event log. Call sites use GB_LOG_EVENT(category, event, a, b); only the
+// categories in the -DGB_LOG=mask build flag are compiled in (none by
+// default, and then the arguments are not even evaluated). A compiled-in
+// event costs a relaxed load of the runtime category mask and, when that
+// category is on, a 24-byte store into the calling thread's ring.
+// Formatting and file I/O happen on a background drain thread, so logging
+// can stay on without distorting emulation timing. A full ring drops
+// records (counted) rather than block.
+#ifndef GB_LOG
+#define GB_LOG 0
+#endif
+
+enum LogCategory : uint32_t {
+    LOG_MBC       = 1 << 0,  // ROM/RAM bank switches
+    LOG_DMA       = 1 << 1,  // OAM DMA transfers
+    LOG_PPU       = 1 << 2,  // Per-frame statistics
+    LOG_CPU       = 1 << 3,  // Illegal opcodes
+    LOG_INTERRUPT = 1 << 4,  // Interrupt dispatch
+    LOG_OAM       = 1 << 5,  // CPU writes to OAM
+    LOG_SERIAL    = 1 << 6,  // Link port bytes
+    LOG_ALL       = 0xFFFFFFFF
+};
+
+enum class LogEvent : uint16_t {
+    ROM_BANK,
+    RAM_BANK,
+    OAM_DMA,
+    FRAME_SPRITES,
+    ILLEGAL_OPCODE,
+    INTERRUPT,
+    OAM_WRITE,
+    SERIAL_BYTE,
+    COUNT
+};
+
+struct LogRecord {
+    uint64_t cycle;    // Master cycle of the machine that logged it
+    uint16_t event;    // LogEvent
+    uint16_t thread;   // Logging thread, in order of first use
+    uint32_t a;
+    uint32_t b;
+};
+
+// One producer (the thread that owns it) and one consumer (the drain thread)
+class LogRing {
+private:
+    static const size_t CAPACITY = 1 << 14;
+    std::array<LogRecord, CAPACITY> records;
+    std::atomic<uint64_t> head;     // Next slot to write, only the producer stores
+    std::atomic<uint64_t> tail;     // Next slot to read, only the consumer stores
+    std::atomic<uint64_t> dropped;
+
+public:
+    const uint16_t thread;
+
+    explicit LogRing(uint16_t thread_index) : head(0), tail(0), dropped(0), thread(thread_index) {}
+
+    void push(const LogRecord& record) {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == CAPACITY) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        records[h & (CAPACITY - 1)] = record;
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    template<class F>
+    void drain(F&& consume) {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        uint64_t h = head.load(std::memory_order_acquire);
+        for (; t != h; t++) {
+            consume(records[t & (CAPACITY - 1)]);
+        }
+        tail.store(t, std::memory_order_release);
+    }
+
+    uint64_t droppedCount() const { return dropped.load(std::memory_order_relaxed); }
+};
+
+class Logger {
+private:
+    struct EventInfo {
+        const char* name;
+        LogCategory category;
+        const char* format;  // printf format for a, b
+    };
+
+    std::mutex mutex;                          // Guards rings and out
+    std::vector<std::unique_ptr<LogRing>> rings;
+    std::atomic<uint32_t> categories;          // Runtime filter, 0 = off
+    std::ofstream out;
+    std::thread drain_thread;
+    std::condition_variable wake;
+    bool stopping;
+
+    static thread_local LogRing* local_ring;
+    static thread_local const uint64_t* local_clock;
+
+    Logger() : categories(0), stopping(false) {}
+
+    ~Logger() {
+        stop();
+    }
+
+    LogRing* registerThread() {
+        std::lock_guard<std::mutex> lock(mutex);
+        rings.push_back(std::make_unique<LogRing>((uint16_t)rings.size()));
+        return rings.back().get();
+    }
+
+    void writeRecord(const LogRecord& record) {
+        const EventInfo& info = eventInfo((LogEvent)record.event);
+        char args[64];
+        std::snprintf(args, sizeof(args), info.format, record.a, record.b);
+        char line[128];
+        std::snprintf(line, sizeof(line), "%12llu t%u %-9s %-14s %s\n",
+                      (unsigned long long)record.cycle, record.thread,
+                      categoryName(info.category), info.name, args);
+        out << line;
+    }
+
+    void drainAll() {
+        for (auto& ring : rings) {
+            ring->drain([&](const LogRecord& record) { writeRecord(record); });
+        }
+        out.flush();
+    }
+
+    void drainLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            wake.wait_for(lock, std::chrono::milliseconds(20));
+            drainAll();
+        }
+    }
+
+public:
+    static Logger& get() {
+        static Logger logger;
+        return logger;
+    }
+
+    static const EventInfo& eventInfo(LogEvent event) {
+        static const EventInfo INFO[(int)LogEvent::COUNT] = {
+            {"rom_bank",       LOG_MBC,       "bank=%u"},
+            {"ram_bank",       LOG_MBC,       "bank=%u"},
+            {"oam_dma",        LOG_DMA,       "source=%04X"},
+            {"frame_sprites",  LOG_PPU,       "sprites=%u frame=%u"},
+            {"illegal_opcode", LOG_CPU,       "opcode=%02X pc=%04X"},
+            {"interrupt",      LOG_INTERRUPT, "vector=%02X pc=%04X"},
+            {"oam_write",      LOG_OAM,       "addr=%04X value=%02X"},
+            {"serial_byte",    LOG_SERIAL,    "value=%02X"},
+        };
+        return INFO[(int)event];
+    }
+
+    static const char* categoryName(uint32_t category) {
+        static const char* NAMES[] = {"mbc", "dma", "ppu", "cpu", "interrupt", "oam", "serial"};
+        for (int i = 0; i < 7; i++) {
+            if (category == (1u << i)) return NAMES[i];
+        }
+        return "?";
+    }
+
+    // "mbc,dma" -> LOG_MBC | LOG_DMA, "all" -> everything; 0 if a name is unknown
+    static uint32_t parseCategories(const std::string& list) {
+        if (list == "all") return LOG_ALL;
+        uint32_t mask = 0;
+        size_t start = 0;
+        while (start <= list.size()) {
+            size_t end = list.find(',', start);
+            if (end == std::string::npos) end = list.size();
+            std::string name = list.substr(start, end - start);
+            uint32_t bit = 0;
+            for (int i = 0; i < 7; i++) {
+                if (name == categoryName(1u << i)) bit = 1u << i;
+            }
+            if (!bit) return 0;
+            mask |= bit;
+            start = end + 1;
+        }
+        return mask;
+    }
+
+    bool enabled(uint32_t category) const {
+        return categories.load(std::memory_order_relaxed) & category;
+    }
+
+    // Cycle counter stamped on this thread's records from now on
+    static void setClock(const uint64_t* clock) { local_clock = clock; }
+
+    void record(LogEvent event, uint32_t a, uint32_t b) {
+        if (!local_ring) {
+            local_ring = registerThread();
+        }
+        local_ring->push({local_clock ? *local_clock : 0, (uint16_t)event, local_ring->thread, a, b});
+    }
+
+    bool start(const std::string& filename, uint32_t mask) {
+        out.open(filename);
+        if (!out.is_open()) {
+            std::cout << "Could not write " << filename << std::endl;
+            return false;
+        }
+        stopping = false;
+        drain_thread = std::thread([this] { drainLoop(); });
+        categories.store(mask & GB_LOG, std::memory_order_relaxed);
+        return true;
+    }
+
+    void stop() {
+        if (!drain_thread.joinable()) {
+            return;
+        }
+        categories.store(0, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        drain_thread.join();
+        drainAll();  // Whatever came in after the last pass
+        uint64_t dropped = 0;
+        for (auto& ring : rings) {
+            dropped += ring->droppedCount();
+        }
+        if (dropped) {
+            std::cout << "Log: " << dropped << " records dropped (ring full)" << std::endl;
+        }
+        out.close();
+    }
+};
+
+thread_local LogRing* Logger::local_ring = nullptr;
+thread_local const uint64_t* Logger::local_clock = nullptr;
+
+#define GB_LOG_EVENT(category, event, a, b) \
+    do { \
+        if constexpr ((GB_LOG & (category)) != 0) { \
+            if (Logger::get().enabled(category)) Logger::get().record(event, a, b); \
+        } \
+    } while (0)
+
+#define GB_LOG_CLOCK(clock) \
+    do { \
+        if constexpr (GB_LOG != 0) Logger::setClock(clock); \
+    } while (0)
+
+// Receives every byte the game sends over the link port
+class SerialSink {
+public:
+    virtual ~SerialSink() {}
+    virtual void onSerialByte(uint8_t value) = 0;
+};
+
+// Writes each serial byte to a log file, then passes it on to `next`
+class SerialLogSink : public SerialSink {
+private:
+    std::ofstream logfile;
+    SerialSink* next;
+
+public:
+    SerialLogSink(const std::string& filename, SerialSink* next_sink = nullptr)
+        : logfile(filename), next(next_sink) {}
+
+    void onSerialByte(uint8_t value) override {
+        logfile << "Char: '" << (char)value << "' (0x" << std::hex << (int)value << ")" << std::dec << '\n';
+        if (next) {
+            next->onSerialByte(value);
+        }
+    }
+};
+
+// Watches serial output for the pass/fail signatures of test ROMs:
+// Blargg's print "Passed" or "Failed", Mooneye's send the Fibonacci bytes
+// 3 5 8 13 21 34 on success and six 0x42 bytes on failure.
+class SerialTestMatcher : public SerialSink {
+public:
+    enum Result { RUNNING, PASSED, FAILED };
+
+private:
+    static const size_t TAIL_LENGTH = 256;
+    std::string tail;  // Last bytes received, for matching and reports
+    Result result;
+
+    bool endsWith(const char* pattern, size_t length) const {
+        return tail.size() >= length && tail.compare(tail.size() - length, length, pattern, length) == 0;
+    }
+
+public:
+    SerialTestMatcher() : result(RUNNING) {}
+
+    void onSerialByte(uint8_t value) override {
+        if (result != RUNNING) {
+            return;
+        }
+        tail += (char)value;
+        if (tail.size() > TAIL_LENGTH * 2) {
+            tail.erase(0, tail.size() - TAIL_LENGTH);
+        }
+
+        static const char MOONEYE_PASS[] = {3, 5, 8, 13, 21, 34};
+        static const char MOONEYE_FAIL[] = {0x42, 0x42, 0x42, 0x42, 0x42, 0x42};
+        if (endsWith("Passed", 6) || endsWith(MOONEYE_PASS, sizeof(MOONEYE_PASS))) {
+            result = PASSED;
+        } else if (endsWith("Failed", 6) || endsWith(MOONEYE_FAIL, sizeof(MOONEYE_FAIL))) {
+            result = FAILED;
+        }
+    }
+
+    Result getResult() const { return result; }
+
+    // Printable end of the output, one line
+    std::string printableTail(size_t max_length = 80) const {
+        std::string text;
+        size_t start = tail.size() > max_length ? tail.size() - max_length : 0;
+        for (size_t i = start; i < tail.size(); i++) {
+            char c = tail[i];
+            text += (c >= 32 && c < 127) ? c : ' ';
+        }
+        return text;
+    }
+};
+
+// Instruction trace: CPU state before every executed instruction, kept in
+// a ring of the most recent entries. Dumps are binary:
+//   "GBTR", version byte, entry count (u32), then raw TraceEntry records
+struct TraceEntry {
+    uint8_t a, f, b, c, d, e, h, l;
+    uint16_t sp, pc;
+    uint8_t pcmem[4];  // Opcode and the next 3 bytes
+    uint64_t cycle;    // Emulated cycles since power on
+};
+
+class TraceRing {
+private:
+    std::vector<TraceEntry> entries;
+    size_t mask;
+    uint64_t written;  // Total entries ever recorded
+
+public:
+    static const uint8_t VERSION = 1;
+
+    // Capacity is rounded up to a power of two
+    TraceRing(size_t capacity) : written(0) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        entries.resize(size);
+        mask = size - 1;
+    }
+
+    TraceEntry& next() {
+        return entries[written++ & mask];
+    }
+
+    size_t size() const { return (size_t)std::min<uint64_t>(written, entries.size()); }
+
+    bool dump(const std::string& filename) const {
+        std::ofstream file(filename, std::ios::binary);
+        if (!file) {
+            std::cout << "Could not write " << filename << std::endl;
+            return false;
+        }
+        uint32_t count = (uint32_t)size();
+        file.write("GBTR", 4);
+        file.put((char)VERSION);
+        file.write(reinterpret_cast<const char*>(&count), 4);
+        // Oldest first
+        for (uint64_t i = written - count; i < written; i++) {
+            file.write(reinterpret_cast<const char*>(&entries[i & mask]), sizeof(TraceEntry));
+        }
+        std::cout << "Wrote " << count << " trace entries to " << filename << std::endl;
+        return true;
+    }
+
+    // One line in gameboy-doctor's format
+    static std::string doctorLine(const TraceEntry& entry) {
+        char line[96];
+        std::snprintf(line, sizeof(line),
+                      "A:%02X F:%02X B:%02X C:%02X D:%02X E:%02X H:%02X L:%02X SP:%04X PC:%04X PCMEM:%02X,%02X,%02X,%02X",
+                      entry.a, entry.f, entry.b, entry.c, entry.d, entry.e, entry.h, entry.l, entry.sp, entry.pc,
+                      entry.pcmem[0], entry.pcmem[1], entry.pcmem[2], entry.pcmem[3]);
+        return line;
+    }
+};
+
+// Reads a binary trace dump or a gameboy-doctor text log one line at a time
+class TraceReader {
+private:
+    std::ifstream file;
+    bool binary;
+    uint32_t remaining;  // Entries left in a binary dump
+
+public:
+    bool open(const std::string& filename) {
+        file.open(filename, std::ios::binary);
+        if (!file) {
+            std::cout << "Could not open trace " << filename << std::endl;
+            return false;
+        }
+        char magic[4] = {};
+        file.read(magic, 4);
+        binary = file && std::memcmp(magic, "GBTR", 4) == 0;
+        if (binary) {
+            if (file.get() != TraceRing::VERSION || !file.read(reinterpret_cast<char*>(&remaining), 4)) {
+                std::cout << "Unsupported trace file " << filename << std::endl;
+                return false;
+            }
+        } else {
+            file.clear();
+            file.seekg(0);
+        }
+        return true;
+    }
+
+    // Next line in doctor format; false at the end
+    bool next(std::string& line) {
+        if (binary) {
+            TraceEntry entry;
+            if (remaining == 0 || !file.read(reinterpret_cast<char*>(&entry), sizeof(entry))) {
+                return false;
+            }
+            remaining--;
+            line = TraceRing::doctorLine(entry);
+            return true;
+        }
+        while (std::getline(file, line)) {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (!line.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Things that happen at a known future cycle (end of an OAM DMA, a TIMA
+// overflow, a PPU mode change, ...).
+// Every kind of event has one fixed slot, so scheduling is a store and
+// finding the next one is a scan over a handful of entries, no heap.
+// advance() is called with the cycles the machine has run and fires
+// whatever became due, in time order.
+class Scheduler {
+public:
+    enum Event {
+        OAM_DMA,
+        TIMER_OVERFLOW,
+        PPU_MODE,
+        EVENT_COUNT
+    };
+
+    static constexpr uint64_t NEVER = UINT64_MAX;
+
+    // Called with the cycle the event was due at (now may be a bit later)
+    using Handler = void (*)(void* context, uint64_t when);
+
+    struct State {
+        uint64_t now;
+        std::array<uint64_t, EVENT_COUNT> when;
+    };
+
+private:
+    uint64_t now;                              // Master cycle counter
+    uint64_t next;                             // Earliest entry of `when`
+    std::array<uint64_t, EVENT_COUNT> when;    // NEVER when not scheduled
+    std::array<Handler, EVENT_COUNT> handlers;
+    std::array<void*, EVENT_COUNT> contexts;
+
+    void updateNext() {
+        next = NEVER;
+        for (uint64_t at : when) {
+            next = std::min(next, at);
+        }
+    }
+
+    void fireNext() {
+        int event = 0;
+        for (int i = 1; i < EVENT_COUNT; i++) {
+            if (when[i] < when[event]) event = i;
+        }
+        uint64_t at = when[event];
+        when[event] = NEVER;
+        updateNext();
+        handlers[event](contexts[event], at);
+    }
+
+public:
+    Scheduler() : now(0), next(NEVER) {
+        when.fill(NEVER);
+        handlers.fill(nullptr);
+        contexts.fill(nullptr);
+    }
+
+    void setHandler(Event event, Handler handler, void* context) {
+        handlers[event] = handler;
+        contexts[event] = context;
+    }
+
+    void saveState(State& state) const {
+        state.now = now;
+        state.when = when;
+    }
+
+    void loadState(const State& state) {
+        now = state.now;
+        when = state.when;
+        updateNext();
+    }
+
+    uint64_t getNow() const { return now; }
+    const uint64_t* clock() const { return &now; }  // For stamping log records
+    uint64_t nextEventTime() const { return next; }
+    bool isScheduled(Event event) const { return when[event] != NEVER; }
+    uint64_t eventTime(Event event) const { return when[event]; }
+
+    void schedule(Event event, uint64_t at) {
+        when[event] = at;
+        updateNext();
+    }
+
+    void cancel(Event event) {
+        when[event] = NEVER;
+        updateNext();
+    }
+
+    void advance(int cycles) {
+        now += cycles;
+        while (next <= now) {
+            fireNext();
+        }
+    }
+};
+
+// Cartridge image, shared read-only by every instance running the same game
+using ROMImage = std::shared_ptr<const std::vector<uint8_t>>;
+
 class Memory {
 private:
-    std::vector<uint8_t> rom;           // Cartridge ROM
+    ROMImage rom_image;                 // Cartridge ROM
+    const uint8_t* rom;                 // rom_image->data(), kept for the read path
+    size_t rom_size;
     std::array<uint8_t, 0x2000> vram;   // Video RAM
     std::array<uint8_t, 0x2000> wram;   // Work RAM
     std::array<uint8_t, 0xA0> oam;      // Sprite attribute table
     std::array<uint8_t, 0x80> hram;     // High RAM
     std::array<uint8_t, 0x80> io;       // I/O registers
+
+    // VRAM writes that changed a byte so far, and that count as of the last
+    // change to each tile (8000-97FF) and each tile map row (9800-9FFF)
+    uint64_t vram_writes;
+    std::array<uint64_t, 384> tile_stamps;
+    std::array<uint64_t, 64> map_row_stamps;
     
     uint8_t ie_register;                // Interrupt Enable
     uint8_t if_register;                // Interrupt Flag
+    uint8_t pending_interrupts;         // ie & if & 0x1F, kept in step with both
     uint8_t joypad_buttons;    // Buttons: START, SELECT, B, A
     uint8_t joypad_directions; // Directions: DOWN, UP, LEFT, RIGHT
     APU* apu;                          // Audio Processing Unit pointer
+    Timer* timer;                      // Owns DIV/TIMA/TMA/TAC when set
+    PPU* ppu;                          // Owns STAT/LY/LYC when set
+    SerialSink* serial_sink;           // Outgoing link port bytes, may be null
+#ifdef GB_INSTRUMENT
+    ExecutionProfile* profile;
+#endif
+    Scheduler* scheduler;              // Clock for timed transfers, may be null
     int rom_bank;           // Current ROM bank (1-127)
     int ram_bank;           // Current RAM bank (0-3)
     bool ram_enabled;       // Is external RAM enabled?
     uint8_t banking_mode;   // 0 = ROM banking, 1 = RAM banking
-    std::vector<uint8_t> ext_ram;  // External RAM (32KB max)
+    std::array<uint8_t, 0x8000> ext_ram;  // External RAM (32KB max)
+
+    // OAM DMA in flight. OAM is filled in lazily: the bytes are copied when
+    // the transfer ends, or earlier if something could tell the difference
+    bool dma_active;
+    uint16_t dma_source;    // XX00
+    uint64_t dma_start;     // Cycle the first byte is transferred on
+    int dma_copied;         // Bytes already in oam
+
+    static constexpr int DMA_LENGTH = 0xA0;
+    static constexpr int DMA_CYCLES = DMA_LENGTH * 4;  // One byte per M-cycle
 
 public:
+    // Everything except the ROM image, so snapshots stay cheap to copy
+    struct State {
+        std::array<uint8_t, 0x2000> vram;
+        std::array<uint8_t, 0x2000> wram;
+        std::array<uint8_t, 0xA0> oam;
+        std::array<uint8_t, 0x80> hram;
+        std::array<uint8_t, 0x80> io;
+        std::array<uint8_t, 0x8000> ext_ram;
+        uint8_t ie_register;
+        uint8_t if_register;
+        uint8_t joypad_buttons;
+        uint8_t joypad_directions;
+        int rom_bank;
+        int ram_bank;
+        bool ram_enabled;
+        uint8_t banking_mode;
+        bool dma_active;
+        uint16_t dma_source;
+        uint64_t dma_start;
+        int dma_copied;
+    };
+
     Memory() {
+        rom = nullptr;
+        rom_size = 0;
         vram.fill(0);
+        vram_writes = 0;
+        tile_stamps.fill(0);
+        map_row_stamps.fill(0);
         wram.fill(0);
         oam.fill(0);
         hram.fill(0);
         io.fill(0);
+        io[0x40] = 0x91;  // LCDC as the boot ROM leaves it
         ie_register = 0;
         if_register = 0;
+        pending_interrupts = 0;
         joypad_buttons = 0x0F;    // All released (1 = not pressed)
         joypad_directions = 0x0F; // All released
         apu = nullptr;
+        timer = nullptr;
+        ppu = nullptr;
+        serial_sink = nullptr;
+#ifdef GB_INSTRUMENT
+        profile = nullptr;
+#endif
         rom_bank = 1;  // Bank 0 is always mapped to 0x0000-0x3FFF
         ram_bank = 0;
         ram_enabled = false;
         banking_mode = 0;
-        ext_ram.resize(0x8000, 0);  // 32KB
+        ext_ram.fill(0);  // 32KB
+        scheduler = nullptr;
+        dma_active = false;
+        dma_source = 0;
+        dma_start = 0;
+        dma_copied = 0;
+    }
+
+    void saveState(State& state) const {
+        state.vram = vram;
+        state.wram = wram;
+        state.oam = oam;
+        state.hram = hram;
+        state.io = io;
+        state.ext_ram = ext_ram;
+        state.ie_register = ie_register;
+        state.if_register = if_register;
+        state.joypad_buttons = joypad_buttons;
+        state.joypad_directions = joypad_directions;
+        state.rom_bank = rom_bank;
+        state.ram_bank = ram_bank;
+        state.ram_enabled = ram_enabled;
+        state.banking_mode = banking_mode;
+        state.dma_active = dma_active;
+        state.dma_source = dma_source;
+        state.dma_start = dma_start;
+        state.dma_copied = dma_copied;
+    }
+
+    void loadState(const State& state) {
+        restoreVRAM(state.vram);
+        wram = state.wram;
+        oam = state.oam;
+        hram = state.hram;
+        io = state.io;
+        ext_ram = state.ext_ram;
+        ie_register = state.ie_register;
+        if_register = state.if_register;
+        updatePendingInterrupts();
+        joypad_buttons = state.joypad_buttons;
+        joypad_directions = state.joypad_directions;
+        rom_bank = state.rom_bank;
+        ram_bank = state.ram_bank;
+        ram_enabled = state.ram_enabled;
+        banking_mode = state.banking_mode;
+        dma_active = state.dma_active;
+        dma_source = state.dma_source;
+        dma_start = state.dma_start;
+        dma_copied = state.dma_copied;
     }
     
-    bool loadROM(const std::string& filename) {
+    static ROMImage readROMFile(const std::string& filename) {
         std::ifstream file(filename, std::ios::binary | std::ios::ate);
         if (!file.is_open()) {
             std::cerr << "Failed to open ROM: " << filename << std::endl;
-            return false;
+            return nullptr;
         }
         
         size_t size = file.tellg();
         file.seekg(0, std::ios::beg);
         
-        rom.resize(size);
-        file.read(reinterpret_cast<char*>(rom.data()), size);
+        auto image = std::make_shared<std::vector<uint8_t>>(size);
+        file.read(reinterpret_cast<char*>(image->data()), size);
         file.close();
         
         std::cout << "Loaded ROM: " << filename << " (" << size << " bytes)" << std::endl;
+        return image;
+    }
+
+    bool loadROM(const std::string& filename) {
+        ROMImage image = readROMFile(filename);
+        if (!image) {
+            return false;
+        }
+        setROM(image);
         return true;
     }
 
-    void incrementDIV() {
-        io[0x04] = (io[0x04] + 1) & 0xFF;
+    void setROM(const ROMImage& image) {
+        rom_image = image;
+        rom = rom_image->data();
+        rom_size = rom_image->size();
     }
-    
+
+    // FNV-1a of the whole image, used to check a movie matches the ROM
+    uint32_t romHash() const {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < rom_size; i++) {
+            hash = (hash ^ rom[i]) * 16777619u;
+        }
+        return hash;
+    }
+
     void setAPU(APU* apu_ptr) { apu = apu_ptr; }
+    void setTimer(Timer* timer_ptr) { timer = timer_ptr; }
+    void setPPU(PPU* ppu_ptr) { ppu = ppu_ptr; }
+
+    // Sets bits in IF (0x01 VBlank, 0x04 timer, 0x10 joypad, ...)
+    void requestInterrupt(uint8_t mask) {
+        if_register |= mask;
+        updatePendingInterrupts();
+    }
+
+    // Clears an IF bit as the CPU dispatches it (not a bus access)
+    void acknowledgeInterrupt(uint8_t mask) {
+        if_register &= ~mask;
+        updatePendingInterrupts();
+    }
+
+    // Enabled and requested interrupts, without touching the bus
+    uint8_t pendingInterrupts() const { return pending_interrupts; }
+    void setSerialSink(SerialSink* sink) { serial_sink = sink; }
+
+    // The end of an OAM DMA is a scheduler event. Without a scheduler the
+    // transfer happens at once, like on the write
+    void setScheduler(Scheduler* s) {
+        scheduler = s;
+        scheduler->setHandler(Scheduler::OAM_DMA, [](void* context, uint64_t) {
+            static_cast<Memory*>(context)->finishDMA();
+        }, this);
+    }
+
+    // OAM is only up to date as far as the transfer got, see syncDMA()
+    bool isDMAActive() const { return dma_active; }
+
+    // Dirty tracking for the PPU's background row cache: a row drawn when
+    // vramWrites() was N is still good if none of its tiles or its map row
+    // have a stamp above N
+    uint64_t vramWrites() const { return vram_writes; }
+    uint64_t tileStamp(uint16_t tile_addr) const { return tile_stamps[(tile_addr - 0x8000) >> 4]; }
+    uint64_t mapRowStamp(uint16_t map_addr) const { return map_row_stamps[(map_addr - 0x9800) >> 5]; }
+
+    // ROM bank that `addr` currently maps to, or -1 outside ROM
+    int bankAt(uint16_t addr) const {
+        if (addr < 0x4000) return 0;
+        if (addr < 0x8000) return rom_bank;
+        return -1;
+    }
+
+#ifdef GB_INSTRUMENT
+    void setProfile(ExecutionProfile* p) { profile = p; }
+#endif
     
+    // Read without it counting as a CPU bus access: not profiled and not
+    // subject to OAM DMA bus conflicts (used by the PPU and by tools)
+    uint8_t peek(uint16_t addr) {
+        if (dma_active && addr >= 0xFE00 && addr < 0xFEA0) {
+            syncDMA();
+        }
+        return readDirect(addr);
+    }
+
     uint8_t read(uint16_t addr) {
+#ifdef GB_INSTRUMENT
+        if (profile) profile->region_reads[ExecutionProfile::regionOf(addr)]++;
+#endif
+        if (dma_active && addr < 0xFF00) {
+            return readDuringDMA(addr);
+        }
+        return readDirect(addr);
+    }
+
+private:
+    void updatePendingInterrupts() {
+        pending_interrupts = ie_register & if_register & 0x1F;
+    }
+
+    // Index of the byte the DMA is transferring on the current cycle
+    // (DMA_LENGTH once it is done)
+    int dmaProgress() const {
+        uint64_t now = scheduler->getNow();
+        if (now < dma_start) return 0;
+        return (int)std::min<uint64_t>(DMA_LENGTH, (now - dma_start) / 4);
+    }
+
+    // Where DMA byte `index` comes from. Sources from 0xE000 up read the
+    // WRAM echo, like the hardware does
+    uint8_t dmaByte(int index) {
+        uint16_t addr = dma_source + index;
+        if (addr >= 0xE000) addr -= 0x2000;
+        return readDirect(addr);
+    }
+
+    // The whole source page as one contiguous block, when it is one
+    const uint8_t* dmaSourcePage() const {
+        uint16_t addr = dma_source;
+        if (addr >= 0xE000) addr -= 0x2000;
+        if (addr < 0x8000) {
+            size_t offset = addr < 0x4000 ? addr : rom_bank * 0x4000 + (addr - 0x4000);
+            return offset + DMA_LENGTH <= rom_size ? rom + offset : nullptr;
+        }
+        if (addr < 0xA000) return &vram[addr - 0x8000];
+        if (addr < 0xC000) return ram_enabled ? &ext_ram[ram_bank * 0x2000 + (addr - 0xA000)] : nullptr;
+        return &wram[addr - 0xC000];
+    }
+
+    void stampVRAM(int offset) {
+        vram_writes++;
+        if (offset < 0x1800) {
+            tile_stamps[offset >> 4] = vram_writes;
+        } else {
+            map_row_stamps[(offset - 0x1800) >> 5] = vram_writes;
+        }
+    }
+
+    // Loading a snapshot counts as writing whatever tiles and rows differ
+    void restoreVRAM(const std::array<uint8_t, 0x2000>& data) {
+        for (int offset = 0; offset < 0x1800; offset += 16) {
+            if (std::memcmp(&vram[offset], &data[offset], 16) != 0) {
+                stampVRAM(offset);
+            }
+        }
+        for (int offset = 0x1800; offset < 0x2000; offset += 32) {
+            if (std::memcmp(&vram[offset], &data[offset], 32) != 0) {
+                stampVRAM(offset);
+            }
+        }
+        vram = data;
+    }
+
+    void copyDMA(int end) {
+        if (end <= dma_copied) return;
+        if (const uint8_t* page = dmaSourcePage()) {
+            std::memcpy(&oam[dma_copied], page + dma_copied, end - dma_copied);
+        } else {
+            for (int i = dma_copied; i < end; i++) {
+                oam[i] = dmaByte(i);
+            }
+        }
+        dma_copied = end;
+        oamChanged();
+    }
+
+    // Bring OAM up to the bytes transferred so far, before anything sees it
+    // or the source memory changes underneath the transfer
+    void syncDMA() {
+        copyDMA(dmaProgress());
+    }
+
+    void startDMA(uint8_t page) {
+        if (dma_active) {
+            syncDMA();  // A new transfer cuts the old one short
+        }
+        dma_source = page << 8;
+        dma_copied = 0;
+        GB_LOG_EVENT(LOG_DMA, LogEvent::OAM_DMA, dma_source, 0);
+        if (!scheduler) {
+            copyDMA(DMA_LENGTH);
+            return;
+        }
+        dma_active = true;
+        dma_start = scheduler->getNow() + 4;  // One M-cycle of setup
+        scheduler->schedule(Scheduler::OAM_DMA, dma_start + DMA_CYCLES);
+    }
+
+    void finishDMA() {
+        copyDMA(DMA_LENGTH);
+        dma_active = false;
+    }
+
+    // CPU read while OAM DMA owns the bus. OAM itself reads 0xFF, and a read
+    // on the same bus as the source (VRAM, or the external bus for
+    // everything else) gets the byte the DMA is moving instead. HRAM and
+    // I/O never get here.
+    uint8_t readDuringDMA(uint16_t addr) {
+        if (addr >= 0xFE00) return 0xFF;
+        bool video_bus = addr >= 0x8000 && addr < 0xA000;
+        bool dma_video_bus = dma_source >= 0x8000 && dma_source < 0xA000;
+        if (video_bus != dma_video_bus) {
+            return readDirect(addr);
+        }
+        return dmaByte(std::min(dmaProgress(), DMA_LENGTH - 1));
+    }
+
+    // Timer and PPU registers are computed by them, defined after them
+    uint8_t readTimer(uint16_t addr);
+    void writeTimer(uint16_t addr, uint8_t value);
+    uint8_t readPPU(uint16_t addr);
+    void writePPU(uint16_t addr, uint8_t value);
+    void syncPPU();
+    void oamChanged();
+
+    uint8_t readDirect(uint16_t addr) {
     // ROM Bank 0
         if (addr < 0x4000) {
-            if (addr < rom.size()) return rom[addr];
+            if (addr < rom_size) return rom[addr];
             return 0xFF;
         }
         // Switchable ROM Bank
         else if (addr >= 0x4000 && addr < 0x8000) {
             uint32_t rom_addr = (rom_bank * 0x4000) + (addr - 0x4000);
-            if (rom_addr < rom.size()) return rom[rom_addr];
+            if (rom_addr < rom_size) return rom[rom_addr];
             return 0xFF;
         }
         // VRAM
@@ -150,6 +1264,12 @@ public:
             if (addr == 0xFF0F) {
                 return if_register;
             }
+            if (addr >= 0xFF04 && addr <= 0xFF07 && timer) {
+                return readTimer(addr);
+            }
+            if ((addr == 0xFF41 || addr == 0xFF44 || addr == 0xFF45) && ppu) {
+                return readPPU(addr);
+            }
             return io[addr - 0xFF00];
         }
         // High RAM
@@ -163,8 +1283,16 @@ public:
         
         return 0xFF;
     }
-    
+
+public:
     void write(uint16_t addr, uint8_t value) {
+#ifdef GB_INSTRUMENT
+        if (profile) profile->region_writes[ExecutionProfile::regionOf(addr)]++;
+#endif
+        if (dma_active && addr < 0xFF00) {
+            if (addr >= 0xFE00) return;  // OAM is busy
+            syncDMA();  // The write may change the source (or its bank)
+        }
         // MBC1 Register writes
         if (addr < 0x2000) {
             // 0x0000-0x1FFF: RAM Enable
@@ -176,16 +1304,18 @@ public:
             int bank = value & 0x1F;
             if (bank == 0) bank = 1;  // Bank 0 is not allowed
             rom_bank = bank;
-            std::cout << "ROM Bank switched to: " << rom_bank << std::endl;
+            GB_LOG_EVENT(LOG_MBC, LogEvent::ROM_BANK, rom_bank, 0);
             return;
         }
         else if (addr >= 0x4000 && addr < 0x6000) {
             // 0x4000-0x5FFF: RAM Bank Number or upper ROM bank bits
             if (banking_mode == 1) {
                 ram_bank = value & 0x03;
+                GB_LOG_EVENT(LOG_MBC, LogEvent::RAM_BANK, ram_bank, 0);
             } else {
                 // Upper 2 bits of ROM bank for large ROMs
                 rom_bank = (rom_bank & 0x1F) | ((value & 0x03) << 5);
+                GB_LOG_EVENT(LOG_MBC, LogEvent::ROM_BANK, rom_bank, 0);
             }
             return;
         }
@@ -203,45 +1333,15 @@ public:
             return;
         }
         
-        if (addr == 0xFF01) {
-            static std::ofstream logfile("serial_log.txt");
-            static std::string buffer;
-            
-            char c = (char)value;
-            //std::cout << c << std::flush;
-            
-            // Log with hex values
-            logfile << "Char: '" << c << "' (0x" << std::hex << (int)(uint8_t)value << ")" << std::dec << std::endl;
-            
-            buffer += c;
-            
-            // Check for common Blargg test completion patterns
-            if (buffer.find("Passed") != std::string::npos && 
-                buffer.find("\n\n") != std::string::npos) {
-                std::cout << "\n\n=== TEST PASSED ===" << std::endl;
-                logfile << "\n=== TEST PASSED ===" << std::endl;
-                logfile << "Full buffer: " << buffer << std::endl;
-                logfile.close();
-                exit(0);
-            }
-            
-            if (buffer.find("Failed") != std::string::npos) {
-                std::cout << "\n\n=== TEST FAILED ===" << std::endl;
-                logfile << "\n=== TEST FAILED ===" << std::endl;
-                logfile << "Full buffer: " << buffer << std::endl;
-                logfile.close();
-                exit(1);
-            }
-            
-            // Keep buffer manageable
-            if (buffer.length() > 1000) {
-                buffer = buffer.substr(buffer.length() - 1000);
-            }
-        }
         if (addr == 0xFF02) {
             // Serial Control register
             // Bit 7: Transfer Start Flag (0=No transfer, 1=Transfer in progress)
             if (value & 0x80) {
+                // The byte in SB goes out as the transfer starts
+                GB_LOG_EVENT(LOG_SERIAL, LogEvent::SERIAL_BYTE, io[0x01], 0);
+                if (serial_sink) {
+                    serial_sink->onSerialByte(io[0x01]);
+                }
                 // Transfer starts - we handle it immediately and clear bit 7
                 // In a real Game Boy, this takes ~8 clock cycles, but for emulation
                 // we can clear it immediately to allow the ROM to continue
@@ -252,6 +1352,10 @@ public:
             }
             return;
         }
+        if (addr >= 0xFF04 && addr <= 0xFF07 && timer) {
+            writeTimer(addr, value);
+            return;
+        }
         if (addr == 0xFF04){
             // Writing to DIV resets it
             io[0x04] = 0;
@@ -264,7 +1368,10 @@ public:
         }
         else if (addr >= 0x8000 && addr < 0xA000) {
             // VRAM
-            vram[addr - 0x8000] = value;
+            if (vram[addr - 0x8000] != value) {
+                vram[addr - 0x8000] = value;
+                stampVRAM(addr - 0x8000);
+            }
         }
         else if (addr >= 0xC000 && addr < 0xE000) {
             // Work RAM
@@ -272,14 +1379,9 @@ public:
         }
         else if (addr >= 0xFE00 && addr < 0xFEA0) {
             // OAM
-            static bool first_oam_write = true;
-            if (first_oam_write && value != 0) {
-                std::cout << "\n!!! FIRST OAM WRITE !!!" << std::endl;
-                std::cout << "Address: 0x" << std::hex << addr << std::dec << std::endl;
-                std::cout << "Value: 0x" << std::hex << (int)value << std::dec << std::endl;
-                first_oam_write = false;
-            }
+            GB_LOG_EVENT(LOG_OAM, LogEvent::OAM_WRITE, addr, value);
             oam[addr - 0xFE00] = value;
+            oamChanged();
         }
         else if (addr >= 0xFF00 && addr < 0xFF80) {
             // I/O Registers
@@ -290,6 +1392,7 @@ public:
             }
             if (addr == 0xFF0F) {
                     if_register = value;
+                    updatePendingInterrupts();
                     return;
                 }
             if (addr >= 0xFF10 && addr <= 0xFF3F) {
@@ -297,18 +1400,22 @@ public:
                 io[addr - 0xFF00] = value;
                 return;
             }
+            if (addr >= 0xFF40 && addr <= 0xFF4B && ppu) {
+                syncPPU();  // The line so far is drawn with the old value
+            }
+            if (addr >= 0xFF40 && addr <= 0xFF45 && addr != 0xFF42 && addr != 0xFF43 && ppu) {
+                if (addr == 0xFF40) {
+                    io[0x40] = value;  // The renderer reads LCDC from here
+                }
+                writePPU(addr, value);
+                return;
+            }
 
 
             if (addr == 0xFF46) {
-                    // DMA Transfer: Copy 160 bytes from XX00-XX9F to OAM (FE00-FE9F)
-                    uint16_t source = value << 8;  // Value * 0x100
-                    
-                    //std::cout << "DMA Transfer from 0x" << std::hex << source 
-                    //       << " to OAM" << std::dec << std::endl;
-                    
-                    for (int i = 0; i < 0xA0; i++) {
-                        oam[i] = read(source + i);
-                    }
+                    // DMA Transfer: 160 bytes from XX00-XX9F to OAM (FE00-FE9F),
+                    // one per M-cycle in the background
+                    startDMA(value);
                     io[0x46] = value;  // Store the DMA register value
                     return;
                 }
@@ -322,6 +1429,7 @@ public:
         else if (addr == 0xFFFF) {
             // Interrupt Enable
             ie_register = value;
+            updatePendingInterrupts();
         }
         
     }
@@ -330,9 +1438,7 @@ public:
     // Button presses (bit 0 = pressed, 1 = not pressed)
     void pressButton(int button) {
         joypad_buttons &= ~(1 << button);
-
-        uint8_t if_flag = read(0xFF0F);
-        write(0xFF0F, if_flag | 0x10);  // Set bit 4 (joypad interrupt)
+        requestInterrupt(0x10);  // Set bit 4 (joypad interrupt)
     }
 
     void releaseButton(int button) {
@@ -345,8 +1451,7 @@ public:
 
     void releaseDirection(int direction) {
         joypad_directions |= (1 << direction);
-        uint8_t if_flag = read(0xFF0F);
-        write(0xFF0F, if_flag | 0x10);
+        requestInterrupt(0x10);
     }
     
     // Button/Direction constants
@@ -366,75 +1471,190 @@ public:
 
 };
 
+// DIV and TIMA are not stepped: they are worked out from the scheduler's
+// master cycle counter when a register is read or written. The internal
+// 16-bit divider is (now - div_base); TIMA counts falling edges of one of
+// its bits (selected by TAC) since tima_sync. The only thing that happens
+// on its own is a TIMA overflow, which is a scheduler event at the cycle
+// TMA gets reloaded, one M-cycle after the overflowing edge.
 class Timer {
 private:
     Memory* memory;
-    int divider_counter;
-    int timer_counter;
-    
+    Scheduler* scheduler;
+    uint64_t div_base;    // Cycle the divider was last 0
+    uint64_t tima_sync;   // Cycle `tima` is up to date at
+    uint8_t tima;
+    uint8_t tma;
+    uint8_t tac;
+
+    // log2 of the TIMA period, i.e. the divider bit TIMA follows plus one
+    int periodShift() const {
+        static const int shifts[4] = {10, 4, 6, 8};  // 4096, 262144, 65536, 16384 Hz
+        return shifts[tac & 0x03];
+    }
+
+    bool enabled() const { return tac & 0x04; }
+
+    // Edges seen so far on the divider bit TIMA follows
+    uint64_t edgesAt(uint64_t cycle) const {
+        return (cycle - div_base) >> periodShift();
+    }
+
+    // What the timer circuit ANDs into its edge detector
+    bool timerSignal(uint64_t cycle) const {
+        return enabled() && (((cycle - div_base) >> (periodShift() - 1)) & 1);
+    }
+
+    // Bring tima up to `now`. Never runs past an overflow, the reload event
+    // is due before the next edge.
+    void sync() {
+        uint64_t now = scheduler->getNow();
+        if (enabled()) {
+            tima = (uint8_t)(tima + (edgesAt(now) - edgesAt(tima_sync)));
+        }
+        tima_sync = now;
+    }
+
+    void scheduleOverflow() {
+        if (!enabled()) {
+            scheduler->cancel(Scheduler::TIMER_OVERFLOW);
+            return;
+        }
+        uint64_t edge = edgesAt(tima_sync) + (256 - tima);
+        scheduler->schedule(Scheduler::TIMER_OVERFLOW, div_base + (edge << periodShift()) + 4);
+    }
+
+    // TIMA has wrapped to 0 and TMA is reloaded at the end of this M-cycle.
+    // Only a TIMA write cancels that; DIV and TAC writes leave it alone.
+    bool reloadPending() const {
+        return scheduler->isScheduled(Scheduler::TIMER_OVERFLOW) &&
+               scheduler->eventTime(Scheduler::TIMER_OVERFLOW) <= tima_sync + 4;
+    }
+
+    // An extra edge from a DIV or TAC write (the "falling edge" glitches)
+    void glitchIncrement() {
+        if (reloadPending()) {
+            tima++;  // Overwritten by the reload
+        } else if (tima == 0xFF) {
+            tima = 0;
+            scheduler->schedule(Scheduler::TIMER_OVERFLOW, tima_sync + 4);
+        } else {
+            tima++;
+            scheduleOverflow();
+        }
+    }
+
+    void onOverflow(uint64_t when) {
+        tima = tma;
+        tima_sync = when;
+        memory->requestInterrupt(0x04);
+        scheduleOverflow();
+    }
+
 public:
-    Timer(Memory* mem) : memory(mem), divider_counter(0), timer_counter(0) {}
-    
-    void step(int cycles) {
-    // Update DIV register (increments at 16384 Hz)
-    divider_counter += cycles;
-    if (divider_counter >= 256) {
-        divider_counter -= 256;
-        memory->incrementDIV();  // ✅ Bypass the reset handler
+    Timer(Memory* mem, Scheduler* sched)
+        : memory(mem), scheduler(sched), div_base(0), tima_sync(0), tima(0), tma(0), tac(0) {
+        scheduler->setHandler(Scheduler::TIMER_OVERFLOW, [](void* context, uint64_t when) {
+            static_cast<Timer*>(context)->onOverflow(when);
+        }, this);
     }
-    
-    // Check if timer is enabled
-    uint8_t tac = memory->read(0xFF07);
-    if (tac & 0x04) {
-        timer_counter += cycles;
-        
-        int frequency = 0;
-        switch (tac & 0x03) {
-            case 0: frequency = 1024; break;
-            case 1: frequency = 16;   break;
-            case 2: frequency = 64;   break;
-            case 3: frequency = 256;  break;
+
+    struct State {
+        uint64_t div_base;
+        uint64_t tima_sync;
+        uint8_t tima;
+        uint8_t tma;
+        uint8_t tac;
+    };
+
+    void saveState(State& state) const {
+        state.div_base = div_base;
+        state.tima_sync = tima_sync;
+        state.tima = tima;
+        state.tma = tma;
+        state.tac = tac;
+    }
+
+    void loadState(const State& state) {
+        div_base = state.div_base;
+        tima_sync = state.tima_sync;
+        tima = state.tima;
+        tma = state.tma;
+        tac = state.tac;
+    }
+
+    uint8_t readRegister(uint16_t addr) {
+        switch (addr) {
+            case 0xFF04: return (uint8_t)((scheduler->getNow() - div_base) >> 8);
+            case 0xFF05: sync(); return tima;
+            case 0xFF06: return tma;
+            default:     return tac | 0xF8;
         }
-        
-        if (timer_counter >= frequency) {
-            timer_counter -= frequency;
-            
-            uint8_t tima = memory->read(0xFF05);
-            if (tima == 0xFF) {
-                uint8_t tma = memory->read(0xFF06);
-                memory->write(0xFF05, tma);
-                
-                uint8_t if_flag = memory->read(0xFF0F);
-                memory->write(0xFF0F, if_flag | 0x04);
-            } else {
-                memory->write(0xFF05, tima + 1);
+    }
+
+    void writeRegister(uint16_t addr, uint8_t value) {
+        sync();
+        uint64_t now = tima_sync;
+        switch (addr) {
+            case 0xFF04: {
+                // Resetting the divider drops the bit TIMA follows
+                bool was_high = timerSignal(now);
+                div_base = now;
+                if (was_high) {
+                    glitchIncrement();
+                } else if (!reloadPending()) {
+                    scheduleOverflow();
+                }
+                break;
+            }
+            case 0xFF05:
+                // A write in the M-cycle before the reload cancels it
+                tima = value;
+                scheduleOverflow();
+                break;
+            case 0xFF06:
+                tma = value;
+                break;
+            default: {
+                // Switching off, or to a bit that is low, is a falling edge too
+                bool was_high = timerSignal(now);
+                tac = value & 0x07;
+                if (was_high && !timerSignal(now)) {
+                    glitchIncrement();
+                } else if (!reloadPending()) {
+                    scheduleOverflow();
+                }
+                break;
             }
         }
     }
-}
 };
 
+inline uint8_t Memory::readTimer(uint16_t addr) {
+    return timer->readRegister(addr);
+}
+
+inline void Memory::writeTimer(uint16_t addr, uint8_t value) {
+    timer->writeRegister(addr, value);
+}
+
 class APU {
 private:
     Memory* memory;
     
-    // Channel 1: Square wave with sweep
-    struct {
+    struct SquareChannel {
         bool enabled;
         int frequency;
         int duty;
         int volume;
         float phase;
-    } ch1;
+    };
+
+    // Channel 1: Square wave with sweep
+    SquareChannel ch1;
     
     // Channel 2: Square wave
-    struct {
-        bool enabled;
-        int frequency;
-        int duty;
-        int volume;
-        float phase;
-    } ch2;
+    SquareChannel ch2;
     
     // Audio state
     float sample_timer;
@@ -447,6 +1667,24 @@ public:
         ch2 = {};
         sample_timer = 0.0f;
     }
+
+    struct State {
+        SquareChannel ch1;
+        SquareChannel ch2;
+        float sample_timer;
+    };
+
+    void saveState(State& state) const {
+        state.ch1 = ch1;
+        state.ch2 = ch2;
+        state.sample_timer = sample_timer;
+    }
+
+    void loadState(const State& state) {
+        ch1 = state.ch1;
+        ch2 = state.ch2;
+        sample_timer = state.sample_timer;
+    }
     
     void step(int cycles) {
     // Check if channel 1 was just triggered
@@ -545,22 +1783,38 @@ private:
     
 };
 
-class CPU {
+// SM83 interpreter. Bus is anything with read(addr)/write(addr, value),
+// peek(addr), bankAt(addr), pendingInterrupts() and
+// acknowledgeInterrupt(mask): Memory for the emulator, TickingBus for
+// M-cycle timing, FlatBus for the fuzzer. read/write are bus cycles; peek
+// and the interrupt lines are for looking at state (traces, IE & IF)
+// without one.
+template<class Bus>
+class BasicCPU {
 private:
     // Registers
-    struct {
+    struct Registers {
         uint8_t a, f;  // Accumulator & Flags
         uint8_t b, c;
         uint8_t d, e;
         uint8_t h, l;
         uint16_t sp;   // Stack Pointer
         uint16_t pc;   // Program Counter
-    } regs;
+    };
+    Registers regs;
     
-    Memory* memory;
+    Bus* memory;
     bool ime; // Interrupt Master Enable
     bool halted;
     bool ei_pending;
+    bool locked; // Hit an illegal opcode, which hangs the real CPU
+    uint64_t instruction_count; // Opcodes fetched, for benchmarks (not part of State)
+    TraceRing* trace;            // Records every instruction when set
+    const uint64_t* trace_clock; // Cycle count stamped on trace entries
+#ifdef GB_INSTRUMENT
+    ExecutionProfile* profile;
+    uint8_t last_cb_opcode;
+#endif
 
     // Flag helpers
     void setFlag(uint8_t flag, bool value) {
@@ -580,7 +1834,7 @@ public:
     static const uint8_t FLAG_H = 0x20;  // Half Carry
     static const uint8_t FLAG_C = 0x10;  // Carry
     
-    CPU(Memory* mem) : memory(mem) {
+    BasicCPU(Bus* mem) : memory(mem) {
         reset();
     }
     
@@ -599,10 +1853,58 @@ public:
         ime = false;
         halted = false;
         ei_pending = false;
+        locked = false;
+        instruction_count = 0;
+        trace = nullptr;
+        trace_clock = nullptr;
+#ifdef GB_INSTRUMENT
+        profile = nullptr;
+        last_cb_opcode = 0;
+#endif
+    }
+
+    struct State {
+        Registers regs;
+        bool ime;
+        bool halted;
+        bool ei_pending;
+        bool locked;
+    };
+
+    void saveState(State& state) const {
+        state.regs = regs;
+        state.ime = ime;
+        state.halted = halted;
+        state.ei_pending = ei_pending;
+        state.locked = locked;
+    }
+
+    void loadState(const State& state) {
+        regs = state.regs;
+        ime = state.ime;
+        halted = state.halted;
+        ei_pending = state.ei_pending;
+        locked = state.locked;
+    }
+
+    bool isLocked() const { return locked; }
+    bool isHalted() const { return halted; }
+    uint64_t getInstructionCount() const { return instruction_count; }
+    uint16_t getPC() const { return regs.pc; }
+    uint16_t getSP() const { return regs.sp; }
+
+    void setTrace(TraceRing* ring, const uint64_t* clock) {
+        trace = ring;
+        trace_clock = clock;
     }
+#ifdef GB_INSTRUMENT
+    void setProfile(ExecutionProfile* p) { profile = p; }
+#endif
     
     int step() {
-    
+        if (locked) {
+            return 4;
+        }
         
         // ✅ Handle EI delayed enable FIRST
         if (ei_pending) {
@@ -610,11 +1912,13 @@ public:
             ei_pending = false;
         }
         
+        // The bus keeps IE & IF & 0x1F up to date, so with nothing pending
+        // this is a single load and branch
+        uint8_t triggered = memory->pendingInterrupts();
+
         // Handle HALT
         if (halted) {
-            uint8_t ie = memory->read(0xFFFF);
-            uint8_t if_flag = memory->read(0xFF0F);
-            if (ie & if_flag) {
+            if (triggered) {
                 halted = false;
             } else {
                 return 4;
@@ -622,43 +1926,65 @@ public:
         }
         
         // ✅ Handle interrupts (only if IME is enabled)
-        if (ime) {
-            uint8_t ie = memory->read(0xFFFF);
-            uint8_t if_flag = memory->read(0xFF0F);
-            uint8_t triggered = ie & if_flag;
+        if (triggered && ime) {
+            ime = false;  // Disable interrupts
             
-            if (triggered) {
-                ime = false;  // Disable interrupts
-                
-                // Service highest priority interrupt
-                for (int i = 0; i < 5; i++) {
-                    if (triggered & (1 << i)) {
-                        
-                        // Clear the interrupt flag
-                        memory->write(0xFF0F, if_flag & ~(1 << i));
-                        
-                        // Push PC onto stack
-                        memory->write(--regs.sp, (regs.pc >> 8) & 0xFF);
-                        memory->write(--regs.sp, regs.pc & 0xFF);
-                        
-                        // Jump to interrupt vector
-                        regs.pc = 0x0040 + (i * 8);
-                        return 20;
-                    }
+            // Service highest priority interrupt
+            for (int i = 0; i < 5; i++) {
+                if (triggered & (1 << i)) {
+                    
+                    // Clear the interrupt flag
+                    memory->acknowledgeInterrupt(1 << i);
+                    GB_LOG_EVENT(LOG_INTERRUPT, LogEvent::INTERRUPT, 0x40 + i * 8, regs.pc);
+                    
+                    // Push PC onto stack
+                    memory->write(--regs.sp, (regs.pc >> 8) & 0xFF);
+                    memory->write(--regs.sp, regs.pc & 0xFF);
+                    
+                    // Jump to interrupt vector
+                    regs.pc = 0x0040 + (i * 8);
+                    return 20;
                 }
             }
-        } else {
-        // ✅ ADD THIS - See why interrupts aren't enabled
-        static int debug_counter = 0;
-        if (++debug_counter % 50000 == 0) {
-            uint8_t ie = memory->read(0xFFFF);
-            uint8_t if_flag = memory->read(0xFF0F);
         }
-    }
     
+        if (trace) {
+            TraceEntry& entry = trace->next();
+            entry.a = regs.a; entry.f = regs.f; entry.b = regs.b; entry.c = regs.c;
+            entry.d = regs.d; entry.e = regs.e; entry.h = regs.h; entry.l = regs.l;
+            entry.sp = regs.sp;
+            entry.pc = regs.pc;
+            for (int i = 0; i < 4; i++) {
+                entry.pcmem[i] = memory->peek(regs.pc + i);
+            }
+            entry.cycle = *trace_clock;
+        }
+
         // Fetch opcode
         uint8_t opcode = memory->read(regs.pc++);
-        
+        instruction_count++;
+
+#ifdef GB_INSTRUMENT
+        if (profile) {
+            int bank = memory->bankAt(regs.pc - 1);
+            profile->bank_count[bank < 0 ? ExecutionProfile::MAX_BANKS : std::min(bank, ExecutionProfile::MAX_BANKS - 1)]++;
+            uint64_t start = ExecutionProfile::now();
+            int cycles = execute(opcode);
+            uint64_t ticks = ExecutionProfile::now() - start;
+            profile->opcode_count[opcode]++;
+            profile->opcode_ticks[opcode] += ticks;
+            if (opcode == 0xCB) {
+                profile->cb_count[last_cb_opcode]++;
+                profile->cb_ticks[last_cb_opcode] += ticks;
+            }
+            return cycles;
+        }
+#endif
+        return execute(opcode);
+    }
+
+    // Decode and execute one fetched opcode, returns T-cycles taken
+    int execute(uint8_t opcode) {
         // TODO: Decode and execute
         // Game Boy has ~500 opcodes!
         // Start with the most common ones
@@ -2505,16 +3831,19 @@ public:
             // Reference: https://gbdev.io/pandocs/CPU_Instruction_Set.html
             
            default:
-                std::cout << "Unknown opcode: 0x" << std::hex << (int)opcode 
-                        << " at PC: 0x" << (regs.pc - 1) << std::endl;
-                std::cout << "Registers - A:" << (int)regs.a << " F:" << (int)regs.f 
-                        << " B:" << (int)regs.b << " C:" << (int)regs.c << std::endl;
-                exit(1);  // Stop immediately
+                // Unknown opcode: the CPU hangs here until reset. PC stays on
+                // the opcode so whoever notices (isLocked) can report it.
+                regs.pc--;
+                locked = true;
+                GB_LOG_EVENT(LOG_CPU, LogEvent::ILLEGAL_OPCODE, opcode, regs.pc);
                 return 4;
         }
     }
 
     int executeCB(uint8_t opcode) {
+#ifdef GB_INSTRUMENT
+    last_cb_opcode = opcode;
+#endif
     switch(opcode) {
         case 0x00: // RLC B
             {
@@ -3237,7 +4566,7 @@ public:
                 setFlag(FLAG_Z, !(value & 0x01));
                 setFlag(FLAG_N, false);
                 setFlag(FLAG_H, true);
-                return 16;
+                return 12;
             }
         case 0x47: // BIT 0,A
             {
@@ -3295,7 +4624,7 @@ public:
                 setFlag(FLAG_Z, !(value & 0x02));
                 setFlag(FLAG_N, false);
                 setFlag(FLAG_H, true);
-                return 16;
+                return 12;
             }
         case 0x4F: // BIT 1,A
             {
@@ -3353,7 +4682,7 @@ public:
                 setFlag(FLAG_Z, !(value & 0x04));
                 setFlag(FLAG_N, false);
                 setFlag(FLAG_H, true);
-                return 16;
+                return 12;
             }
         case 0x57: // BIT 2,A
             {
@@ -3411,7 +4740,7 @@ public:
                 setFlag(FLAG_Z, !(value & 0x08));
                 setFlag(FLAG_N, false);
                 setFlag(FLAG_H, true);
-                return 16;
+                return 12;
             }
         case 0x5F: // BIT 3,A
             {
@@ -3469,7 +4798,7 @@ public:
                 setFlag(FLAG_Z, !(value & 0x10));
                 setFlag(FLAG_N, false);
                 setFlag(FLAG_H, true);
-                return 16;
+                return 12;
             }
         case 0x67: // BIT 4,A
             {
@@ -3527,7 +4856,7 @@ public:
                 setFlag(FLAG_Z, !(value & 0x20));
                 setFlag(FLAG_N, false);
                 setFlag(FLAG_H, true);
-                return 16;
+                return 12;
             }
         case 0x6F: // BIT 5,A
             {
@@ -3585,7 +4914,7 @@ public:
                 setFlag(FLAG_Z, !(value & 0x40));
                 setFlag(FLAG_N, false);
                 setFlag(FLAG_H, true);
-                return 16;
+                return 12;
             }
         case 0x77: // BIT 6,A
             {
@@ -3643,7 +4972,7 @@ public:
                 setFlag(FLAG_Z, !(value & 0x80));
                 setFlag(FLAG_N, false);
                 setFlag(FLAG_H, true);
-                return 16;
+                return 12;
             }
         case 0x7F: // BIT 7,A
             {
@@ -4342,8 +5671,7 @@ public:
             }
         // ... 256 cases total
         default:
-            std::cout << "Unknown CB opcode: 0x" << std::hex << (int)opcode 
-                     << " at PC: 0x" << (regs.pc - 1) << std::endl;
+            GB_LOG_EVENT(LOG_CPU, LogEvent::ILLEGAL_OPCODE, 0xCB00 | opcode, regs.pc - 2);
             return 4;}
     }
     
@@ -4357,157 +5685,1143 @@ public:
     void setHL(uint16_t val) { regs.h = val >> 8; regs.l = val & 0xFF; }
 };
 
-class PPU {
+// Plain 64 KB of RAM for running the CPU in isolation. Writes are logged,
+// and everything written can be rolled back to the starting contents.
+class FlatBus {
 private:
-    Memory* memory;
-    std::array<uint32_t, SCREEN_WIDTH * SCREEN_HEIGHT> framebuffer;
-    int mode; // PPU mode
-    int mode_cycles; // Cycles spent in current mode
-    int scanline; // Current scanline (0-153)
-    struct Sprite {
-        uint8_t y;
-        uint8_t x;
-        uint8_t tile;
-        uint8_t flags;
-    };
-    
+    std::array<uint8_t, 0x10000> data;
+    std::vector<std::pair<uint16_t, uint8_t>> undo;  // Address, old value
+
 public:
-    PPU(Memory* mem) : memory(mem) {
-        framebuffer.fill(0xFFFFFFFF);  // White
-        mode = 2;
-        mode_cycles = 0;
-        scanline = 0;
+    std::vector<std::pair<uint16_t, uint8_t>> writes;  // Address, new value
+
+    // Same pseudo-random contents for the same seed
+    void fill(uint32_t seed) {
+        for (uint8_t& byte : data) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            byte = (uint8_t)seed;
+        }
+        undo.clear();
+        writes.clear();
     }
-    
-    void step(int cycles) {
-        
-    mode_cycles += cycles;
-    
-    // Mode 2: OAM Scan (80 cycles)
-    if (mode == 2) {
-        if (mode_cycles >= 80) {
-            mode_cycles -= 80;
-            mode = 3;  // Move to drawing mode
-            
-            uint8_t stat = memory->read(0xFF41);
-            stat = (stat & 0xFC) | mode;
-            memory->write(0xFF41, stat);
+
+    uint8_t read(uint16_t addr) const { return data[addr]; }
+    uint8_t peek(uint16_t addr) const { return data[addr]; }
+
+    void write(uint16_t addr, uint8_t value) {
+        writes.push_back({addr, value});
+        poke(addr, value);
+    }
+
+    // Write without logging it as a CPU write, still undone by rollback()
+    void poke(uint16_t addr, uint8_t value) {
+        undo.push_back({addr, data[addr]});
+        data[addr] = value;
+    }
+
+    void rollback() {
+        for (size_t i = undo.size(); i-- > 0;) {
+            data[undo[i].first] = undo[i].second;
         }
+        undo.clear();
+        writes.clear();
     }
-    // Mode 3: Drawing (172 cycles)
-    else if (mode == 3) {
-        if (mode_cycles >= 172) {  
-            mode_cycles -= 172;
-            mode = 0; 
 
-            renderScanline();
-            
-            uint8_t stat = memory->read(0xFF41);
-            stat = (stat & 0xFC) | mode;
-            memory->write(0xFF41, stat);
+    int bankAt(uint16_t) const { return 0; }
+
+    uint8_t pendingInterrupts() const { return data[0xFFFF] & data[0xFF0F] & 0x1F; }
+
+    // Logged like the IF write ReferenceCPU makes, so the two compare equal
+    void acknowledgeInterrupt(uint8_t mask) {
+        write(0xFF0F, data[0xFF0F] & ~mask);
+    }
+};
+
+// Second SM83 implementation for differential testing against BasicCPU.
+// Written from the opcode bit layout (x = op >> 6, y = op >> 3 & 7,
+// z = op & 7) and cycle tables instead of one case per opcode. It follows
+// the emulator's model where that is a design choice rather than a bug:
+// STOP is a 2-byte no-op, EI takes effect at the start of the next step and
+// an illegal opcode locks the CPU with PC on it.
+class ReferenceCPU {
+public:
+    uint8_t a, f, b, c, d, e, h, l;
+    uint16_t sp, pc;
+    bool ime, halted, ei_pending, locked;
+
+private:
+    FlatBus* bus;
+
+    // Base opcode cycles, branches not taken; 0 = illegal
+    static constexpr uint8_t CYCLES[256] = {
+         4,12, 8, 8, 4, 4, 8, 4,20, 8, 8, 8, 4, 4, 8, 4,
+         4,12, 8, 8, 4, 4, 8, 4,12, 8, 8, 8, 4, 4, 8, 4,
+         8,12, 8, 8, 4, 4, 8, 4, 8, 8, 8, 8, 4, 4, 8, 4,
+         8,12, 8, 8,12,12,12, 4, 8, 8, 8, 8, 4, 4, 8, 4,
+         4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,
+         4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,
+         4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,
+         8, 8, 8, 8, 8, 8, 4, 8, 4, 4, 4, 4, 4, 4, 8, 4,
+         4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,
+         4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,
+         4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,
+         4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,
+         8,12,12,16,12,16, 8,16, 8,16,12, 4,12,24, 8,16,
+         8,12,12, 0,12,16, 8,16, 8,16,12, 0,12, 0, 8,16,
+        12,12, 8, 0, 0,16, 8,16,16, 4,16, 0, 0, 0, 8,16,
+        12,12, 8, 4, 0,16, 8,16,12, 8,16, 4, 0, 0, 8,16,
+    };
+
+    uint8_t fetch() { return bus->read(pc++); }
+    uint16_t fetch16() { uint8_t low = fetch(); return low | (fetch() << 8); }
+
+    void push(uint16_t value) {
+        bus->write(--sp, value >> 8);
+        bus->write(--sp, value & 0xFF);
+    }
+    uint16_t pop() { uint8_t low = bus->read(sp++); return low | (bus->read(sp++) << 8); }
+
+    bool flagZ() const { return f & 0x80; }
+    bool flagN() const { return f & 0x40; }
+    bool flagH() const { return f & 0x20; }
+    bool flagC() const { return f & 0x10; }
+    void setFlags(bool z, bool n, bool hc, bool cy) {
+        f = (z ? 0x80 : 0) | (n ? 0x40 : 0) | (hc ? 0x20 : 0) | (cy ? 0x10 : 0);
+    }
+
+    // r[] operand order: B C D E H L (HL) A
+    uint8_t getR(int i) {
+        switch (i) {
+            case 0: return b; case 1: return c; case 2: return d; case 3: return e;
+            case 4: return h; case 5: return l; case 6: return bus->read(getHL()); default: return a;
         }
     }
-    // Mode 0: H-Blank (204 cycles)
-    else if (mode == 0) {
-        if (mode_cycles >= 204) {  // What goes here?
-            mode_cycles -= 204;
-            
-            // End of scanline - what happens next?
-            scanline++;  
-            
-            if (scanline < 144) {
-                // Still in visible area
-                mode = 2;  // Back to OAM scan
-            } else {
-                // Entering V-Blank
-                mode = 1; // Switch to V-Blank mode
-                  uint8_t if_flag = memory->read(0xFF0F);
-            memory->write(0xFF0F, if_flag | 0x01);
-            }
-            // Update LY register
-            memory->write(0xFF44, scanline);
-            // Update STAT register
-            uint8_t stat = memory->read(0xFF41);
-            stat = (stat & 0xFC) | mode;
-            memory->write(0xFF41, stat);
-            
+    void setR(int i, uint8_t v) {
+        switch (i) {
+            case 0: b = v; break; case 1: c = v; break; case 2: d = v; break; case 3: e = v; break;
+            case 4: h = v; break; case 5: l = v; break; case 6: bus->write(getHL(), v); break; default: a = v; break;
         }
     }
-    // Mode 1: V-Blank (456 cycles per line, 10 lines)
-    else if (mode == 1) {
-        if (mode_cycles >= 456) {  // How many cycles per V-Blank line?
-            mode_cycles -= 456;
-            scanline++;
-            
-            if (scanline > 153) {  // When does V-Blank end? (hint: line 153)
-                // Start new frame
-                scanline = 0;
-                mode = 2;  // Back to OAM scan
-            }
 
-            static int frame_count = 0;
-            if (++frame_count % 60 == 0) {  // Every 60 frames (1 second)
-            }
+    uint16_t getHL() const { return (h << 8) | l; }
+    // rp[] order: BC DE HL SP; rp2[] (push/pop) has AF instead of SP
+    uint16_t getRP(int p, bool af) const {
+        switch (p) {
+            case 0: return (b << 8) | c;
+            case 1: return (d << 8) | e;
+            case 2: return getHL();
+            default: return af ? ((a << 8) | f) : sp;
         }
-        
-        
-            
-            // Update LY register
-            memory->write(0xFF44, scanline);
-            
-            // Update STAT register
-            uint8_t stat = memory->read(0xFF41);
-            stat = (stat & 0xFC) | mode;
-            memory->write(0xFF41, stat);
+    }
+    void setRP(int p, uint16_t v, bool af) {
+        switch (p) {
+            case 0: b = v >> 8; c = v & 0xFF; break;
+            case 1: d = v >> 8; e = v & 0xFF; break;
+            case 2: h = v >> 8; l = v & 0xFF; break;
+            default:
+                if (af) { a = v >> 8; f = v & 0xF0; } else { sp = v; }
+                break;
         }
     }
 
-void renderScanline() {
-    uint8_t lcdc = memory->read(0xFF40);
-    
-    if (!(lcdc & 0x80)) return;  // LCD off
-    
-    uint8_t wy = memory->read(0xFF4A);  // Window Y
-    uint8_t wx = memory->read(0xFF4B);  // Window X
-    bool window_enabled = (lcdc & 0x20) && (scanline >= wy);
-    
-    // Background rendering (existing code)
-    if (lcdc & 0x01) {
-        uint8_t scy = memory->read(0xFF42);
-        uint8_t scx = memory->read(0xFF43);
-        uint16_t tile_map_base = (lcdc & 0x08) ? 0x9C00 : 0x9800;
-        bool use_signed = !(lcdc & 0x10);
-        uint16_t tile_data_base = use_signed ? 0x9000 : 0x8000;
-        
-        uint8_t bg_y = (scanline + scy) & 0xFF;
-        uint8_t tile_row = bg_y / 8;
-        uint8_t pixel_row = bg_y % 8;
-        
-        for (int x = 0; x < SCREEN_WIDTH; x++) {
-            if (window_enabled && x >= (wx - 7)) {
-                // Draw window pixel instead
-                uint16_t win_tile_map = (lcdc & 0x40) ? 0x9C00 : 0x9800;
-                int win_y = scanline - wy;
-                int win_x = x - (wx - 7);
-                
-                uint8_t win_tile_row = win_y / 8;
-                uint8_t win_pixel_row = win_y % 8;
+    // cc[] order: NZ Z NC C
+    bool condition(int cc) const {
+        switch (cc) {
+            case 0: return !flagZ(); case 1: return flagZ(); case 2: return !flagC(); default: return flagC();
+        }
+    }
+
+    // alu[] order: ADD ADC SUB SBC AND XOR OR CP
+    void alu(int op, uint8_t v) {
+        int carry = (op == 1 || op == 3) && flagC() ? 1 : 0;
+        switch (op) {
+            case 0: case 1: {
+                int result = a + v + carry;
+                setFlags((result & 0xFF) == 0, false, (a & 0xF) + (v & 0xF) + carry > 0xF, result > 0xFF);
+                a = result;
+                break;
+            }
+            case 2: case 3: case 7: {
+                int result = a - v - carry;
+                setFlags((result & 0xFF) == 0, true, (a & 0xF) - (v & 0xF) - carry < 0, result < 0);
+                if (op != 7) a = result;
+                break;
+            }
+            case 4: a &= v; setFlags(a == 0, false, true, false); break;
+            case 5: a ^= v; setFlags(a == 0, false, false, false); break;
+            default: a |= v; setFlags(a == 0, false, false, false); break;
+        }
+    }
+
+    // SP plus signed immediate, flags from the unsigned low byte add
+    uint16_t addSP() {
+        uint8_t offset = fetch();
+        setFlags(false, false, (sp & 0xF) + (offset & 0xF) > 0xF, (sp & 0xFF) + offset > 0xFF);
+        return sp + (int8_t)offset;
+    }
+
+    int executeCB() {
+        uint8_t op = fetch();
+        int x = op >> 6, y = (op >> 3) & 7, z = op & 7;
+        uint8_t v = getR(z);
+        if (x == 1) {
+            // BIT leaves C alone
+            f = (f & 0x10) | ((v >> y) & 1 ? 0 : 0x80) | 0x20;
+            return z == 6 ? 12 : 8;
+        }
+        if (x == 2) {
+            v &= ~(1 << y);
+        } else if (x == 3) {
+            v |= 1 << y;
+        } else {
+            bool cy;
+            switch (y) {
+                case 0: cy = v & 0x80; v = (v << 1) | (v >> 7); break;             // RLC
+                case 1: cy = v & 1; v = (v >> 1) | (v << 7); break;                // RRC
+                case 2: cy = v & 0x80; v = (v << 1) | (flagC() ? 1 : 0); break;    // RL
+                case 3: cy = v & 1; v = (v >> 1) | (flagC() ? 0x80 : 0); break;    // RR
+                case 4: cy = v & 0x80; v <<= 1; break;                             // SLA
+                case 5: cy = v & 1; v = (v >> 1) | (v & 0x80); break;              // SRA
+                case 6: cy = false; v = (v << 4) | (v >> 4); break;                // SWAP
+                default: cy = v & 1; v >>= 1; break;                               // SRL
+            }
+            setFlags(v == 0, false, false, cy);
+        }
+        setR(z, v);
+        return z == 6 ? 16 : 8;
+    }
+
+public:
+    ReferenceCPU(FlatBus* b) : bus(b) {}
+
+    int step() {
+        if (locked) {
+            return 4;
+        }
+        if (ei_pending) {
+            ime = true;
+            ei_pending = false;
+        }
+        uint8_t if_flag = bus->read(0xFF0F);
+        uint8_t pending = bus->read(0xFFFF) & if_flag & 0x1F;
+        if (halted) {
+            if (!pending) {
+                return 4;
+            }
+            halted = false;
+        }
+        if (ime && pending) {
+            int i = 0;
+            while (!(pending & (1 << i))) {
+                i++;
+            }
+            ime = false;
+            bus->write(0xFF0F, if_flag & ~(1 << i));
+            push(pc);
+            pc = 0x40 + i * 8;
+            return 20;
+        }
+
+        uint8_t op = fetch();
+        int x = op >> 6, y = (op >> 3) & 7, z = op & 7, p = y >> 1, q = y & 1;
+        int cycles = CYCLES[op];
+        if (cycles == 0) {
+            pc--;
+            locked = true;
+            return 4;
+        }
+
+        if (x == 1) {
+            if (op == 0x76) {
+                halted = true;
+            } else {
+                setR(y, getR(z));
+            }
+        } else if (x == 2) {
+            alu(y, getR(z));
+        } else if (x == 0) {
+            switch (z) {
+                case 0:
+                    if (y == 1) {
+                        uint16_t addr = fetch16();
+                        bus->write(addr, sp & 0xFF);
+                        bus->write(addr + 1, sp >> 8);
+                    } else if (y == 2) {
+                        pc++;  // STOP
+                    } else if (y >= 3) {
+                        int8_t offset = (int8_t)fetch();
+                        if (y == 3 || condition(y - 4)) {
+                            pc += offset;
+                            cycles = 12;
+                        }
+                    }
+                    break;
+                case 1:
+                    if (q == 0) {
+                        setRP(p, fetch16(), false);
+                    } else {
+                        uint16_t hl = getHL(), v = getRP(p, false);
+                        f = (f & 0x80) | ((hl & 0xFFF) + (v & 0xFFF) > 0xFFF ? 0x20 : 0) | (hl + v > 0xFFFF ? 0x10 : 0);
+                        setRP(2, hl + v, false);
+                    }
+                    break;
+                case 2: {
+                    uint16_t addr = p == 0 ? getRP(0, false) : p == 1 ? getRP(1, false) : getHL();
+                    if (q == 0) bus->write(addr, a); else a = bus->read(addr);
+                    if (p == 2) setRP(2, addr + 1, false);
+                    if (p == 3) setRP(2, addr - 1, false);
+                    break;
+                }
+                case 3:
+                    setRP(p, getRP(p, false) + (q ? -1 : 1), false);
+                    break;
+                case 4: {
+                    uint8_t v = getR(y) + 1;
+                    f = (f & 0x10) | (v == 0 ? 0x80 : 0) | ((v & 0xF) == 0 ? 0x20 : 0);
+                    setR(y, v);
+                    break;
+                }
+                case 5: {
+                    uint8_t v = getR(y) - 1;
+                    f = (f & 0x10) | (v == 0 ? 0x80 : 0) | 0x40 | ((v & 0xF) == 0xF ? 0x20 : 0);
+                    setR(y, v);
+                    break;
+                }
+                case 6:
+                    setR(y, fetch());
+                    break;
+                default:
+                    switch (y) {
+                        case 0: setFlags(false, false, false, a & 0x80); a = (a << 1) | (a >> 7); break;               // RLCA
+                        case 1: setFlags(false, false, false, a & 1); a = (a >> 1) | (a << 7); break;                  // RRCA
+                        case 2: { bool cy = a & 0x80; a = (a << 1) | (flagC() ? 1 : 0); setFlags(false, false, false, cy); break; }  // RLA
+                        case 3: { bool cy = a & 1; a = (a >> 1) | (flagC() ? 0x80 : 0); setFlags(false, false, false, cy); break; }  // RRA
+                        case 4: {                                                                                       // DAA
+                            bool cy = flagC();
+                            if (!flagN()) {
+                                if (cy || a > 0x99) { a += 0x60; cy = true; }
+                                if (flagH() || (a & 0xF) > 9) a += 0x06;
+                            } else {
+                                if (cy) a -= 0x60;
+                                if (flagH()) a -= 0x06;
+                            }
+                            f = (a == 0 ? 0x80 : 0) | (f & 0x40) | (cy ? 0x10 : 0);
+                            break;
+                        }
+                        case 5: a = ~a; f |= 0x60; break;                                                               // CPL
+                        case 6: f = (f & 0x80) | 0x10; break;                                                           // SCF
+                        default: f = (f & 0x80) | (f & 0x10 ? 0 : 0x10); break;                                         // CCF
+                    }
+                    break;
+            }
+        } else {
+            switch (z) {
+                case 0:
+                    if (y < 4) {
+                        if (condition(y)) {
+                            pc = pop();
+                            cycles = 20;
+                        }
+                    } else if (y == 4) {
+                        bus->write(0xFF00 + fetch(), a);
+                    } else if (y == 5) {
+                        sp = addSP();
+                    } else if (y == 6) {
+                        a = bus->read(0xFF00 + fetch());
+                    } else {
+                        setRP(2, addSP(), false);
+                    }
+                    break;
+                case 1:
+                    if (q == 0) {
+                        setRP(p, pop(), true);
+                    } else if (p == 0 || p == 1) {
+                        pc = pop();
+                        if (p == 1) ime = true;  // RETI
+                    } else if (p == 2) {
+                        pc = getHL();
+                    } else {
+                        sp = getHL();
+                    }
+                    break;
+                case 2:
+                    if (y < 4) {
+                        uint16_t addr = fetch16();
+                        if (condition(y)) {
+                            pc = addr;
+                            cycles = 16;
+                        }
+                    } else if (y == 4) {
+                        bus->write(0xFF00 + c, a);
+                    } else if (y == 5) {
+                        bus->write(fetch16(), a);
+                    } else if (y == 6) {
+                        a = bus->read(0xFF00 + c);
+                    } else {
+                        a = bus->read(fetch16());
+                    }
+                    break;
+                case 3:
+                    if (y == 0) {
+                        pc = fetch16();
+                    } else if (y == 1) {
+                        cycles = executeCB();
+                    } else if (y == 6) {
+                        ime = false;
+                    } else {
+                        ei_pending = true;
+                    }
+                    break;
+                case 4: {
+                    uint16_t addr = fetch16();
+                    if (condition(y)) {
+                        push(pc);
+                        pc = addr;
+                        cycles = 24;
+                    }
+                    break;
+                }
+                case 5:
+                    if (q == 0) {
+                        push(getRP(p, true));
+                    } else {
+                        uint16_t addr = fetch16();
+                        push(pc);
+                        pc = addr;
+                    }
+                    break;
+                case 6:
+                    alu(y, fetch());
+                    break;
+                default:
+                    push(pc);
+                    pc = y * 8;
+                    break;
+            }
+        }
+        return cycles;
+    }
+};
+
+constexpr uint8_t ReferenceCPU::CYCLES[256];
+
+// Runs the same instruction stream through BasicCPU and ReferenceCPU from
+// the same starting state and compares registers, flags, IME/HALT state,
+// cycles and memory writes after every instruction. Input bytes are the
+// starting registers followed by the code placed at PC; the rest of memory
+// is fixed pseudo-random data.
+class CPUFuzzer {
+private:
+    using FuzzCPU = BasicCPU<FlatBus>;
+    static const size_t STATE_BYTES = 13;
+
+    FlatBus bus;
+    FlatBus reference_bus;
+    FuzzCPU cpu;
+    ReferenceCPU reference;
+
+    static std::string describe(const FuzzCPU::State& s, uint8_t opcode) {
+        char text[160];
+        std::snprintf(text, sizeof(text),
+                      "A:%02X F:%02X B:%02X C:%02X D:%02X E:%02X H:%02X L:%02X SP:%04X PC:%04X IME:%d HALT:%d EI:%d LOCK:%d [%02X]",
+                      s.regs.a, s.regs.f, s.regs.b, s.regs.c, s.regs.d, s.regs.e, s.regs.h, s.regs.l,
+                      s.regs.sp, s.regs.pc, s.ime, s.halted, s.ei_pending, s.locked, opcode);
+        return text;
+    }
+
+    FuzzCPU::State referenceState() const {
+        FuzzCPU::State s;
+        s.regs.a = reference.a; s.regs.f = reference.f; s.regs.b = reference.b; s.regs.c = reference.c;
+        s.regs.d = reference.d; s.regs.e = reference.e; s.regs.h = reference.h; s.regs.l = reference.l;
+        s.regs.sp = reference.sp;
+        s.regs.pc = reference.pc;
+        s.ime = reference.ime;
+        s.halted = reference.halted;
+        s.ei_pending = reference.ei_pending;
+        s.locked = reference.locked;
+        return s;
+    }
+
+    static bool sameState(const FuzzCPU::State& x, const FuzzCPU::State& y) {
+        return x.regs.a == y.regs.a && x.regs.f == y.regs.f && x.regs.b == y.regs.b && x.regs.c == y.regs.c &&
+               x.regs.d == y.regs.d && x.regs.e == y.regs.e && x.regs.h == y.regs.h && x.regs.l == y.regs.l &&
+               x.regs.sp == y.regs.sp && x.regs.pc == y.regs.pc && x.ime == y.ime && x.halted == y.halted &&
+               x.ei_pending == y.ei_pending && x.locked == y.locked;
+    }
+
+    // Final value per written address; write order within one instruction
+    // is not part of the comparison
+    static std::map<uint16_t, uint8_t> writeEffects(const FlatBus& b) {
+        std::map<uint16_t, uint8_t> effects;
+        for (const auto& w : b.writes) {
+            effects[w.first] = w.second;
+        }
+        return effects;
+    }
+
+public:
+    static const int MAX_STEPS = 16;
+
+    CPUFuzzer() : cpu(&bus), reference(&reference_bus) {
+        bus.fill(0x2545F491u);
+        reference_bus.fill(0x2545F491u);
+    }
+
+    // Executes up to MAX_STEPS instructions. Returns the number executed, or
+    // -1 on the first mismatch with a description in `report`. `key` gets
+    // the mismatching opcode (0x1xx for CB-prefixed ones).
+    int run(const uint8_t* data, size_t size, std::string* report, int* key) {
+        if (size < STATE_BYTES) {
+            return 0;
+        }
+        FuzzCPU::State start;
+        start.regs.a = data[0]; start.regs.f = data[1] & 0xF0;
+        start.regs.b = data[2]; start.regs.c = data[3]; start.regs.d = data[4]; start.regs.e = data[5];
+        start.regs.h = data[6]; start.regs.l = data[7];
+        start.regs.sp = data[8] | (data[9] << 8);
+        start.regs.pc = data[10] | (data[11] << 8);
+        start.ime = data[12] & 1;
+        start.halted = data[12] & 2;
+        start.ei_pending = data[12] & 4;
+        start.locked = false;
+
+        cpu.loadState(start);
+        reference.a = start.regs.a; reference.f = start.regs.f; reference.b = start.regs.b; reference.c = start.regs.c;
+        reference.d = start.regs.d; reference.e = start.regs.e; reference.h = start.regs.h; reference.l = start.regs.l;
+        reference.sp = start.regs.sp;
+        reference.pc = start.regs.pc;
+        reference.ime = start.ime;
+        reference.halted = start.halted;
+        reference.ei_pending = start.ei_pending;
+        reference.locked = false;
+
+        for (size_t i = STATE_BYTES; i < size; i++) {
+            bus.poke(start.regs.pc + (i - STATE_BYTES), data[i]);
+            reference_bus.poke(start.regs.pc + (i - STATE_BYTES), data[i]);
+        }
+
+        int steps = 0;
+        for (; steps < MAX_STEPS; steps++) {
+            FuzzCPU::State before;
+            cpu.saveState(before);
+            uint8_t opcode = bus.read(before.regs.pc);
+            bus.writes.clear();
+            reference_bus.writes.clear();
+
+            int cycles = cpu.step();
+            int reference_cycles = reference.step();
+
+            FuzzCPU::State after;
+            cpu.saveState(after);
+            FuzzCPU::State expected = referenceState();
+            if (cycles != reference_cycles || !sameState(after, expected) ||
+                writeEffects(bus) != writeEffects(reference_bus)) {
+                if (key) {
+                    *key = opcode == 0xCB ? 0x100 | bus.read(before.regs.pc + 1) : opcode;
+                }
+                if (report) {
+                    std::string text = "before:    " + describe(before, opcode) + "\n";
+                    text += "cpu:       " + describe(after, opcode) + " cycles " + std::to_string(cycles) + "\n";
+                    text += "reference: " + describe(expected, opcode) + " cycles " + std::to_string(reference_cycles) + "\n";
+                    for (const auto& w : writeEffects(bus)) {
+                        text += "  cpu wrote " + std::to_string(w.first) + " = " + std::to_string(w.second) + "\n";
+                    }
+                    for (const auto& w : writeEffects(reference_bus)) {
+                        text += "  reference wrote " + std::to_string(w.first) + " = " + std::to_string(w.second) + "\n";
+                    }
+                    *report = text;
+                }
+                steps = -1;
+                break;
+            }
+            if (after.locked) {
+                steps++;
+                break;
+            }
+        }
+        bus.rollback();
+        reference_bus.rollback();
+        return steps;
+    }
+};
+
+// Mode changes are scheduler events, so between them the PPU costs
+// nothing. LY, STAT and LYC live here and Memory forwards FF41/FF44/FF45
+// to readRegister/writeRegister, so reads see the current line and mode.
+// The STAT interrupt fires on the rising edge of the OR of the enabled
+// sources (mode 0/1/2, LY == LYC), re-evaluated at each event and on
+// writes to STAT, LYC and LCDC.
+//
+// Lines are drawn by renderScanline() all at once when mode 3 ends (the
+// default), or with setFifoRenderer(true) by a dot-by-dot model of the
+// background fetcher and pixel FIFO. That one makes mode 3 as long as the
+// hardware's (172 dots plus SCX fine scroll, window and sprite fetches) and
+// picks up SCX, palette, LCDC and window changes made in the middle of a
+// line, since Memory lets it catch up before each write to FF40-FF4B.
+class PPU {
+private:
+    Memory* memory;
+    Scheduler* scheduler;
+    std::array<uint32_t, SCREEN_WIDTH * SCREEN_HEIGHT> framebuffer;
+    int mode; // PPU mode
+    int scanline; // Current scanline (0-153)
+    bool lcd_on;            // LCDC bit 7, the PPU is stopped while it is clear
+    uint8_t stat_select;    // STAT bits 3-6, the enabled interrupt sources
+    uint8_t lyc;            // LY compare
+    bool stat_line;         // STAT interrupt line after the last evaluation
+    bool rendering_enabled; // Cleared while running frames nobody will see
+    std::array<uint64_t, SCREEN_HEIGHT> line_hashes; // xxHash of each framebuffer row
+    uint32_t frame_sprites; // Sprites drawn on the lines of this frame so far
+    uint32_t frames;        // VBlanks seen, for the log
+    struct Sprite {
+        uint8_t y;
+        uint8_t x;
+        uint8_t tile;
+        uint8_t flags;
+    };
+
+    // Pixel FIFO renderer state for the line being drawn
+    struct Fifo {
+        bool active;             // This line is drawn by the FIFO renderer
+        uint64_t start;          // Cycle mode 3 began
+        int dot;                 // Dots run since then
+        int lx;                  // Next screen X to output
+        int discard;             // SCX & 7 pixels still to drop
+        int stall;               // Dots left of a sprite fetch
+        uint8_t bg[16];          // Background/window color numbers
+        int bg_head;
+        int bg_count;
+        uint8_t obj_color[8];    // Sprite pixels lined up with the front of bg
+        uint8_t obj_flags[8];
+        int fetch_step;          // Dots into the current tile fetch, < 0 in the first one
+        uint8_t fetch_x;         // Tile column being fetched
+        uint8_t fetch_tile;
+        uint8_t fetch_low;
+        uint8_t fetch_high;
+        bool window;             // Fetching the window instead of the background
+        int penalty_tile;        // Only the first sprite fetch in a tile waits for the fetcher
+        Sprite sprites[10];      // Sprites on this line, by X then OAM index
+        int sprite_count;
+        int next_sprite;
+    };
+
+    // Sprites on each line in DMG priority order (X, then OAM index), at
+    // most 10. Rebuilt from OAM only after it is written, DMA runs or the
+    // sprite height changes, not part of the saved state.
+    std::array<std::array<Sprite, 10>, SCREEN_HEIGHT> line_sprites;
+    std::array<uint8_t, SCREEN_HEIGHT> line_sprite_count;
+    bool sprites_dirty;
+    int sprite_height;      // Height line_sprites was built for
+
+    // Background and window of each line as renderScanline() last drew them,
+    // before sprites, and what they were drawn from. A line is copied from
+    // here when the registers match and Memory's stamps show no write to its
+    // map rows or tiles since. Not part of the saved state.
+    struct BackgroundRow {
+        bool valid;
+        uint8_t lcdc, scx, scy, wx, wy, bgp;
+        uint64_t stamp;     // Memory::vramWrites() when it was drawn
+    };
+    std::array<BackgroundRow, SCREEN_HEIGHT> bg_row_keys;
+    std::array<uint32_t, SCREEN_WIDTH * SCREEN_HEIGHT> bg_rows;
+    uint64_t bg_rows_reused;
+    uint64_t bg_rows_drawn;
+
+    bool fifo_renderer;     // Draw lines started from now on with the FIFO
+    Fifo fifo;
+    uint8_t window_line;    // Window rows drawn this frame (FIFO renderer)
+    bool wy_matched;        // LY has matched WY this frame (FIFO renderer)
+
+    static constexpr uint32_t SHADES[4] = {0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000};
+
+    static uint32_t shade(uint8_t palette, uint8_t color) {
+        return SHADES[(palette >> (color * 2)) & 0x03];
+    }
+
+    // BG/window tile data: 8000-8FFF by unsigned index, or 8800-97FF by
+    // signed index around 9000
+    static uint16_t bgTileAddress(uint8_t lcdc, uint8_t tile) {
+        return (lcdc & 0x10) ? 0x8000 + tile * 16 : 0x9000 + (int8_t)tile * 16;
+    }
+
+    static constexpr int MODE2_CYCLES = 80;   // OAM scan
+    static constexpr int MODE3_CYCLES = 172;  // Drawing
+    static constexpr int MODE0_CYCLES = 204;  // H-Blank
+    static constexpr int LINE_CYCLES = 456;   // Also each V-Blank line
+    
+public:
+    PPU(Memory* mem, Scheduler* sched) : memory(mem), scheduler(sched) {
+        framebuffer.fill(0xFFFFFFFF);  // White
+        mode = 2;
+        scanline = 0;
+        lcd_on = true;  // LCDC is 0x91 after the boot ROM
+        stat_select = 0;
+        lyc = 0;
+        stat_line = false;
+        rendering_enabled = true;
+        frame_sprites = 0;
+        frames = 0;
+        sprites_dirty = true;
+        sprite_height = 8;
+        bg_row_keys.fill(BackgroundRow());
+        bg_rows_reused = 0;
+        bg_rows_drawn = 0;
+        fifo_renderer = false;
+        fifo = Fifo();
+        window_line = 0;
+        wy_matched = false;
+        rehashLines();
+        scheduler->setHandler(Scheduler::PPU_MODE, [](void* context, uint64_t when) {
+            static_cast<PPU*>(context)->onModeEnd(when);
+        }, this);
+        scheduler->schedule(Scheduler::PPU_MODE, scheduler->getNow() + MODE2_CYCLES);
+    }
+
+    struct State {
+        std::array<uint32_t, SCREEN_WIDTH * SCREEN_HEIGHT> framebuffer;
+        int mode;
+        int scanline;
+        bool lcd_on;
+        uint8_t stat_select;
+        uint8_t lyc;
+        bool stat_line;
+        Fifo fifo;
+        uint8_t window_line;
+        bool wy_matched;
+    };
+
+    void saveState(State& state) const {
+        state.framebuffer = framebuffer;
+        state.mode = mode;
+        state.scanline = scanline;
+        state.lcd_on = lcd_on;
+        state.stat_select = stat_select;
+        state.lyc = lyc;
+        state.stat_line = stat_line;
+        state.fifo = fifo;
+        state.window_line = window_line;
+        state.wy_matched = wy_matched;
+    }
+
+    void loadState(const State& state) {
+        framebuffer = state.framebuffer;
+        mode = state.mode;
+        scanline = state.scanline;
+        lcd_on = state.lcd_on;
+        stat_select = state.stat_select;
+        lyc = state.lyc;
+        stat_line = state.stat_line;
+        fifo = state.fifo;
+        window_line = state.window_line;
+        wy_matched = state.wy_matched;
+        sprites_dirty = true;  // OAM is being restored too
+        rehashLines();
+    }
+
+    // Timing, LY/STAT and interrupts keep running, only pixel output is skipped
+    void setRenderingEnabled(bool enabled) { rendering_enabled = enabled; }
+
+    // Takes effect from the next line
+    void setFifoRenderer(bool enabled) { fifo_renderer = enabled; }
+
+    void invalidateSprites() { sprites_dirty = true; }
+
+    // Lines renderScanline() copied from the background row cache, and
+    // lines it had to draw
+    uint64_t backgroundRowsReused() const { return bg_rows_reused; }
+    uint64_t backgroundRowsDrawn() const { return bg_rows_drawn; }
+
+    // Draw the current line up to now, before a register it uses changes
+    void catchUp() {
+        if (mode == 3 && fifo.active) {
+            runFifo(scheduler->getNow());
+        }
+    }
+
+    uint8_t readRegister(uint16_t addr) const {
+        switch (addr) {
+            case 0xFF41: return 0x80 | stat_select | ((scanline == lyc) ? 0x04 : 0) | (lcd_on ? mode : 0);
+            case 0xFF44: return scanline;
+            default:     return lyc;
+        }
+    }
+
+    // LCDC (after Memory stored it), STAT, LYC; LY is read-only
+    void writeRegister(uint16_t addr, uint8_t value) {
+        switch (addr) {
+            case 0xFF40:
+                if (!(value & 0x80) && lcd_on) {
+                    // LCD off: LY and the mode read 0 until it is turned back on
+                    lcd_on = false;
+                    mode = 0;
+                    scanline = 0;
+                    scheduler->cancel(Scheduler::PPU_MODE);
+                } else if ((value & 0x80) && !lcd_on) {
+                    lcd_on = true;
+                    mode = 2;
+                    scanline = 0;
+                    scheduler->schedule(Scheduler::PPU_MODE, scheduler->getNow() + MODE2_CYCLES);
+                }
+                break;
+            case 0xFF41:
+                stat_select = value & 0x78;
+                break;
+            case 0xFF45:
+                lyc = value;
+                break;
+            default:
+                return;
+        }
+        updateStatLine();
+    }
+
+private:
+    void updateStatLine() {
+        bool line = lcd_on &&
+            (((stat_select & 0x08) && mode == 0) ||
+             ((stat_select & 0x10) && mode == 1) ||
+             ((stat_select & 0x20) && mode == 2) ||
+             ((stat_select & 0x40) && scanline == lyc));
+        if (line && !stat_line) {
+            memory->requestInterrupt(0x02);
+        }
+        stat_line = line;
+    }
+
+    // The current mode is over at `when`, move on to the next one
+    void onModeEnd(uint64_t when) {
+        int length = 0;
+        if (mode == 2) {
+            mode = 3;  // Move to drawing mode
+            length = MODE3_CYCLES;  // The shortest it can be with the FIFO
+            fifo.active = fifo_renderer;
+            if (fifo.active) {
+                startFifoLine(when);
+            }
+        } else if (mode == 3 && fifo.active) {
+            runFifo(when);
+            if (fifo.lx < SCREEN_WIDTH) {
+                // Sprites or the window stretched the line, every pixel left takes a dot at least
+                scheduler->schedule(Scheduler::PPU_MODE, when + (SCREEN_WIDTH - fifo.lx));
+                return;
+            }
+            mode = 0;
+            length = (int)(fifo.start + LINE_CYCLES - MODE2_CYCLES - when);
+            if (fifo.window) {
+                window_line++;
+            }
+            if (rendering_enabled) {
+                hashLine(scanline);
+            }
+        } else if (mode == 3) {
+            mode = 0;
+            length = MODE0_CYCLES;
+            if (rendering_enabled) {
+                renderScanline();
+                hashLine(scanline);
+            }
+        } else if (mode == 0) {
+            scanline++;
+            if (scanline < 144) {
+                mode = 2;  // Back to OAM scan
+                length = MODE2_CYCLES;
+            } else {
+                mode = 1;  // Entering V-Blank
+                length = LINE_CYCLES;
+                memory->requestInterrupt(0x01);
+                GB_LOG_EVENT(LOG_PPU, LogEvent::FRAME_SPRITES, frame_sprites, frames);
+                frame_sprites = 0;
+                frames++;
+            }
+        } else {
+            scanline++;
+            if (scanline > 153) {
+                // Start new frame
+                scanline = 0;
+                mode = 2;
+                length = MODE2_CYCLES;
+            } else {
+                length = LINE_CYCLES;
+            }
+        }
+        updateStatLine();
+        scheduler->schedule(Scheduler::PPU_MODE, when + length);
+    }
+
+    // Registers the FIFO reads, constant between two catchUp()s
+    struct LineRegisters {
+        uint8_t lcdc, scy, scx, wx, bgp, obp0, obp1;
+    };
+
+    // Mode 2 is over: pick this line's sprites and reset the fetcher
+    void startFifoLine(uint64_t when) {
+        uint8_t lcdc = memory->peek(0xFF40);
+        if (scanline == 0) {
+            window_line = 0;
+            wy_matched = false;
+        }
+        if (scanline == memory->peek(0xFF4A)) {
+            wy_matched = true;
+        }
+
+        fifo = Fifo();
+        fifo.active = true;
+        fifo.start = when;
+        fifo.discard = memory->peek(0xFF43) & 7;
+        fifo.fetch_step = -6;  // The first fetch is thrown away
+        fifo.penalty_tile = -1;
+
+        const std::array<Sprite, 10>& sprites = spritesOnLine(lcdc);
+        fifo.sprite_count = line_sprite_count[scanline];
+        std::copy(sprites.begin(), sprites.begin() + fifo.sprite_count, fifo.sprites);
+        frame_sprites += fifo.sprite_count;
+    }
+
+    // No write since `stamp` to the map row, nor to the tiles of `columns`
+    // entries of it from `first` on
+    bool tilesUnchanged(uint16_t map, int row, int first, int columns, uint8_t lcdc, uint64_t stamp) {
+        uint16_t row_addr = map + row * 32;
+        if (memory->mapRowStamp(row_addr) > stamp) {
+            return false;
+        }
+        for (int i = 0; i < columns; i++) {
+            uint8_t tile = memory->peek(row_addr + ((first + i) & 31));
+            if (memory->tileStamp(bgTileAddress(lcdc, tile)) > stamp) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const std::array<Sprite, 10>& spritesOnLine(uint8_t lcdc) {
+        int height = (lcdc & 0x04) ? 16 : 8;
+        if (sprites_dirty || height != sprite_height || memory->isDMAActive()) {
+            rebuildSpriteIndex(height);
+        }
+        return line_sprites[scanline];
+    }
+
+    // Bucket every sprite into the lines it covers. Each line keeps the
+    // first 10 in OAM order, sorted by X with ties left in OAM order.
+    void rebuildSpriteIndex(int height) {
+        line_sprite_count.fill(0);
+        for (int i = 0; i < 40; i++) {
+            uint16_t oam_addr = 0xFE00 + i * 4;
+            Sprite sprite = {memory->peek(oam_addr), memory->peek(oam_addr + 1),
+                             memory->peek(oam_addr + 2), memory->peek(oam_addr + 3)};
+            int top = sprite.y - 16;
+            int last = std::min(top + height, SCREEN_HEIGHT);
+            for (int line = std::max(top, 0); line < last; line++) {
+                std::array<Sprite, 10>& bucket = line_sprites[line];
+                if (line_sprite_count[line] == 10) {
+                    continue;
+                }
+                int j = line_sprite_count[line]++;
+                while (j > 0 && bucket[j - 1].x > sprite.x) {
+                    bucket[j] = bucket[j - 1];
+                    j--;
+                }
+                bucket[j] = sprite;
+            }
+        }
+        sprite_height = height;
+        sprites_dirty = false;
+    }
+
+    void runFifo(uint64_t now) {
+        LineRegisters regs = {memory->peek(0xFF40), memory->peek(0xFF42), memory->peek(0xFF43),
+                              memory->peek(0xFF4B), memory->peek(0xFF47), memory->peek(0xFF48),
+                              memory->peek(0xFF49)};
+        int target = (int)std::min<uint64_t>(now - fifo.start, LINE_CYCLES);
+        while (fifo.dot < target && fifo.lx < SCREEN_WIDTH) {
+            fifoDot(regs);
+        }
+    }
+
+    void fifoDot(const LineRegisters& regs) {
+        fifo.dot++;
+        if (fifo.stall > 0) {
+            fifo.stall--;
+            return;
+        }
+        fetchStep(regs);
+        if (fifo.bg_count == 0) {
+            return;
+        }
+        if (fifo.discard > 0) {
+            popBackground();
+            fifo.discard--;
+            return;
+        }
+
+        if (!fifo.window && (regs.lcdc & 0x21) == 0x21 && wy_matched && fifo.lx + 7 >= regs.wx) {
+            // Window starts: drop the background and fetch from the window map
+            fifo.window = true;
+            fifo.bg_count = 0;
+            fifo.fetch_x = 0;
+            fifo.fetch_step = 1;
+            return;
+        }
+
+        if ((regs.lcdc & 0x02) && fifo.next_sprite < fifo.sprite_count &&
+            fifo.sprites[fifo.next_sprite].x - 8 <= fifo.lx) {
+            fetchSprite(regs, fifo.sprites[fifo.next_sprite++]);
+            return;
+        }
+
+        uint8_t color = popBackground();
+        uint8_t obj_color = fifo.obj_color[0];
+        uint8_t obj_flags = fifo.obj_flags[0];
+        std::memmove(fifo.obj_color, fifo.obj_color + 1, 7);
+        std::memmove(fifo.obj_flags, fifo.obj_flags + 1, 7);
+        fifo.obj_color[7] = 0;
+
+        if (!rendering_enabled) {
+            // Timing still needs the pixel to leave the FIFO, nobody will see it
+            fifo.lx++;
+            return;
+        }
+        uint32_t pixel = SHADES[0];  // BG and window off
+        if (regs.lcdc & 0x01) {
+            pixel = shade(regs.bgp, color);
+        } else {
+            color = 0;
+        }
+        if (obj_color && (regs.lcdc & 0x02) && (!(obj_flags & 0x80) || color == 0)) {
+            pixel = shade((obj_flags & 0x10) ? regs.obp1 : regs.obp0, obj_color);
+        }
+        framebuffer[scanline * SCREEN_WIDTH + fifo.lx++] = pixel;
+    }
+
+    uint8_t popBackground() {
+        uint8_t color = fifo.bg[fifo.bg_head];
+        fifo.bg_head = (fifo.bg_head + 1) & 15;
+        fifo.bg_count--;
+        return color;
+    }
+
+    // Tile number, low byte and high byte take 2 dots each, then the 8
+    // pixels go in once the FIFO has room for them
+    void fetchStep(const LineRegisters& regs) {
+        if (fifo.fetch_step < 6) {
+            fifo.fetch_step++;
+            int row;
+            if (fifo.window) {
+                row = window_line;
+            } else {
+                row = (scanline + regs.scy) & 0xFF;
+            }
+            if (fifo.fetch_step == 2) {
+                uint16_t map = fifo.window ? ((regs.lcdc & 0x40) ? 0x9C00 : 0x9800)
+                                           : ((regs.lcdc & 0x08) ? 0x9C00 : 0x9800);
+                int column = fifo.window ? fifo.fetch_x : (regs.scx >> 3) + fifo.fetch_x;
+                fifo.fetch_tile = memory->peek(map + (row / 8) * 32 + (column & 31));
+            } else if (fifo.fetch_step == 4) {
+                fifo.fetch_low = memory->peek(bgTileAddress(regs.lcdc, fifo.fetch_tile) + (row % 8) * 2);
+            } else if (fifo.fetch_step == 6) {
+                fifo.fetch_high = memory->peek(bgTileAddress(regs.lcdc, fifo.fetch_tile) + (row % 8) * 2 + 1);
+            }
+            return;
+        }
+        if (fifo.bg_count > 8) {
+            return;
+        }
+        for (int bit = 7; bit >= 0; bit--) {
+            fifo.bg[(fifo.bg_head + fifo.bg_count++) & 15] =
+                ((fifo.fetch_high >> bit) & 1) << 1 | ((fifo.fetch_low >> bit) & 1);
+        }
+        fifo.fetch_x++;
+        fifo.fetch_step = 0;
+    }
+
+    // Merge a sprite into the sprite FIFO. Pixels already there win, which
+    // is the DMG rule since sprites come by X. Costs 6 dots, plus waiting for
+    // the background fetch if it is the first sprite in that tile.
+    void fetchSprite(const LineRegisters& regs, const Sprite& sprite) {
+        int offset = fifo.window ? fifo.lx - (regs.wx - 7) : fifo.lx + regs.scx;
+        int tile = (offset >> 3) + (fifo.window ? 0x100 : 0);
+        int wait = tile == fifo.penalty_tile ? 0 : std::max(0, 5 - (offset & 7));
+        fifo.penalty_tile = tile;
+        fifo.stall = 6 + wait - 1;  // This dot is the first one
+
+        int height = (regs.lcdc & 0x04) ? 16 : 8;
+        int row = scanline - (sprite.y - 16);
+        if (sprite.flags & 0x40) {
+            row = height - 1 - row;
+        }
+        uint8_t tile_num = height == 16 ? (sprite.tile & 0xFE) : sprite.tile;
+        uint16_t tile_addr = 0x8000 + tile_num * 16 + row * 2;
+        uint8_t byte1 = memory->peek(tile_addr);
+        uint8_t byte2 = memory->peek(tile_addr + 1);
+        for (int x = 0; x < 8; x++) {
+            int slot = sprite.x - 8 + x - fifo.lx;
+            if (slot < 0 || fifo.obj_color[slot]) {
+                continue;
+            }
+            int bit = (sprite.flags & 0x20) ? x : (7 - x);
+            fifo.obj_color[slot] = ((byte2 >> bit) & 1) << 1 | ((byte1 >> bit) & 1);
+            fifo.obj_flags[slot] = sprite.flags;
+        }
+    }
+
+public:
+
+void renderScanline() {
+    uint8_t lcdc = memory->peek(0xFF40);
+    
+    if (!(lcdc & 0x80)) return;  // LCD off
+    
+    uint8_t wy = memory->peek(0xFF4A);  // Window Y
+    uint8_t wx = memory->peek(0xFF4B);  // Window X
+    bool window_enabled = (lcdc & 0x20) && (scanline >= wy);
+    
+    // Background rendering (existing code)
+    if (lcdc & 0x01) {
+        uint8_t scy = memory->peek(0xFF42);
+        uint8_t scx = memory->peek(0xFF43);
+        uint8_t bgp = memory->peek(0xFF47);  // Background palette
+        uint16_t tile_map_base = (lcdc & 0x08) ? 0x9C00 : 0x9800;
+        
+        uint8_t bg_y = (scanline + scy) & 0xFF;
+        uint8_t tile_row = bg_y / 8;
+        uint8_t pixel_row = bg_y % 8;
+
+        // Same registers and nothing it was drawn from written since: reuse it
+        BackgroundRow& cached = bg_row_keys[scanline];
+        BackgroundRow key = {true, (uint8_t)(lcdc & 0xF9), scx, scy, wx, wy, bgp, cached.stamp};
+        uint32_t* row = &framebuffer[scanline * SCREEN_WIDTH];
+        uint32_t* cached_row = &bg_rows[scanline * SCREEN_WIDTH];
+        if (cached.valid && key.lcdc == cached.lcdc && scx == cached.scx && scy == cached.scy &&
+            wx == cached.wx && wy == cached.wy && bgp == cached.bgp &&
+            tilesUnchanged(tile_map_base, tile_row, scx / 8, 21, lcdc, cached.stamp) &&
+            (!window_enabled || tilesUnchanged((lcdc & 0x40) ? 0x9C00 : 0x9800, (scanline - wy) / 8, 0, 21, lcdc, cached.stamp))) {
+            std::memcpy(row, cached_row, SCREEN_WIDTH * sizeof(uint32_t));
+            bg_rows_reused++;
+            renderSprites();
+            return;
+        }
+        
+        for (int x = 0; x < SCREEN_WIDTH; x++) {
+            if (window_enabled && x >= (wx - 7)) {
+                // Draw window pixel instead
+                uint16_t win_tile_map = (lcdc & 0x40) ? 0x9C00 : 0x9800;
+                int win_y = scanline - wy;
+                int win_x = x - (wx - 7);
+                
+                uint8_t win_tile_row = win_y / 8;
+                uint8_t win_pixel_row = win_y % 8;
                 uint8_t win_tile_col = win_x / 8;
                 uint8_t win_pixel_col = win_x % 8;
                 
                 uint16_t tile_map_addr = win_tile_map + (win_tile_row * 32) + win_tile_col;
-                uint8_t tile_num = memory->read(tile_map_addr);
+                uint8_t tile_num = memory->peek(tile_map_addr);
                 
-                uint16_t tile_addr;
-                if (use_signed) {
-                    int8_t signed_tile = (int8_t)tile_num;
-                    tile_addr = tile_data_base + ((signed_tile + 128) * 16);
-                } else {
-                    tile_addr = tile_data_base + (tile_num * 16);
-                }
+                uint16_t tile_addr = bgTileAddress(lcdc, tile_num);
                 
-                uint8_t byte1 = memory->read(tile_addr + (win_pixel_row * 2));
-                uint8_t byte2 = memory->read(tile_addr + (win_pixel_row * 2) + 1);
+                uint8_t byte1 = memory->peek(tile_addr + (win_pixel_row * 2));
+                uint8_t byte2 = memory->peek(tile_addr + (win_pixel_row * 2) + 1);
                 
                 int bit = 7 - win_pixel_col;
                 uint8_t color_num = ((byte2 >> bit) & 1) << 1 | ((byte1 >> bit) & 1);
@@ -4528,306 +6842,3687 @@ void renderScanline() {
                 uint8_t pixel_col = bg_x % 8;
                 
                 uint16_t tile_map_addr = tile_map_base + (tile_row * 32) + tile_col;
-                uint8_t tile_num = memory->read(tile_map_addr);
+                uint8_t tile_num = memory->peek(tile_map_addr);
                 
-                uint16_t tile_addr;
-                if (use_signed) {
-                    int8_t signed_tile = (int8_t)tile_num;
-                    tile_addr = tile_data_base + ((signed_tile + 128) * 16);
-                } else {
-                    tile_addr = tile_data_base + (tile_num * 16);
-                }
+                uint16_t tile_addr = bgTileAddress(lcdc, tile_num);
                 
-                uint8_t byte1 = memory->read(tile_addr + (pixel_row * 2));
-                uint8_t byte2 = memory->read(tile_addr + (pixel_row * 2) + 1);
+                uint8_t byte1 = memory->peek(tile_addr + (pixel_row * 2));
+                uint8_t byte2 = memory->peek(tile_addr + (pixel_row * 2) + 1);
                 
                 int bit = 7 - pixel_col;
                 uint8_t color_num = ((byte2 >> bit) & 1) << 1 | ((byte1 >> bit) & 1);
                 
                 // Instead of hardcoded colors, read BGP register
-                uint8_t bgp = memory->read(0xFF47);  // Background palette
                 uint8_t palette_color = (bgp >> (color_num * 2)) & 0x03;
 
-                uint32_t color;
-                switch (palette_color) {
-                    case 0: color = 0xFFFFFFFF; break;
-                    case 1: color = 0xFFAAAAAA; break;
-                    case 2: color = 0xFF555555; break;
-                    case 3: color = 0xFF000000; break;
+                uint32_t color;
+                switch (palette_color) {
+                    case 0: color = 0xFFFFFFFF; break;
+                    case 1: color = 0xFFAAAAAA; break;
+                    case 2: color = 0xFF555555; break;
+                    case 3: color = 0xFF000000; break;
+                }
+                
+                framebuffer[scanline * SCREEN_WIDTH + x] = color;
+            }
+        }
+
+        std::memcpy(cached_row, row, SCREEN_WIDTH * sizeof(uint32_t));
+        key.stamp = memory->vramWrites();
+        cached = key;
+        bg_rows_drawn++;
+    }
+    
+    renderSprites();  
+}
+
+void renderSprites() {
+    uint8_t lcdc = memory->peek(0xFF40);
+    
+    // Check if sprites are enabled (bit 1)
+    if (!(lcdc & 0x02)) {
+        return;
+    }
+    
+    // Sprite height: 8x8 or 8x16 (bit 2)
+    int sprite_height = (lcdc & 0x04) ? 16 : 8;
+    
+    // Sprites on current scanline (max 10 per line), highest priority first
+    const std::array<Sprite, 10>& sprites = spritesOnLine(lcdc);
+    int sprite_count = line_sprite_count[scanline];
+    
+    frame_sprites += sprite_count;
+    
+    // Draw sprites (in reverse order for priority)
+    for (int i = sprite_count - 1; i >= 0; i--) {
+        const Sprite& sprite = sprites[i];
+        
+        int sprite_y = sprite.y - 16;
+        int sprite_x = sprite.x - 8;
+        
+        // Get sprite attributes
+        bool flip_y = sprite.flags & 0x40;
+        bool flip_x = sprite.flags & 0x20;
+        bool behind_bg = sprite.flags & 0x80;
+        uint8_t palette_num = (sprite.flags & 0x10) ? 1 : 0;
+        
+        // Calculate which row of the sprite we're drawing
+        int sprite_row = scanline - sprite_y;
+        if (flip_y) {
+            sprite_row = sprite_height - 1 - sprite_row;
+        }
+        
+        // Get tile data
+        uint16_t tile_addr = 0x8000 + (sprite.tile * 16) + (sprite_row * 2);
+        
+        if (sprite_height == 16) {
+            tile_addr = 0x8000 + ((sprite.tile & 0xFE) * 16) + (sprite_row * 2);
+        }
+        
+        uint8_t byte1 = memory->peek(tile_addr);
+        uint8_t byte2 = memory->peek(tile_addr + 1);
+        
+        // Draw 8 pixels
+        for (int x = 0; x < 8; x++) {
+            int screen_x = sprite_x + x;
+            
+            if (screen_x < 0 || screen_x >= SCREEN_WIDTH) continue;
+            
+            int bit = flip_x ? x : (7 - x);
+            uint8_t color_num = ((byte2 >> bit) & 1) << 1 | ((byte1 >> bit) & 1);
+            
+            if (color_num == 0) continue;
+            
+            uint8_t palette = memory->peek(palette_num ? 0xFF49 : 0xFF48);
+            uint8_t palette_color = (palette >> (color_num * 2)) & 0x03;
+            
+            uint32_t color;
+            switch (palette_color) {
+                case 0: color = 0xFFFFFFFF; break;
+                case 1: color = 0xFFAAAAAA; break;
+                case 2: color = 0xFF555555; break;
+                case 3: color = 0xFF000000; break;
+            }
+            
+            int fb_index = scanline * SCREEN_WIDTH + screen_x;
+            if (behind_bg) {
+                if (framebuffer[fb_index] == 0xFFFFFFFF) {
+                    framebuffer[fb_index] = color;
+                }
+            } else {
+                framebuffer[fb_index] = color;
+            }
+        }
+    }
+}
+
+void drawTile(int tile_num, int x, int y) {
+   uint16_t tile_addr = 0x8000 + (tile_num * 16);
+   for (int row = 0; row < 8; row++) {
+        uint8_t byte1 = memory->peek(tile_addr + row * 2);
+        uint8_t byte2 = memory->peek(tile_addr + row * 2 + 1);
+        for (int col = 0; col < 8; col++) {
+            int bit = 7 - col;
+            uint8_t color_num = ((byte2 >> bit) & 1) << 1 | ((byte1 >> bit) & 1);
+            uint32_t color;
+            switch (color_num) {
+                case 0: color = 0xFFFFFFFF; break; // White
+                case 1: color = 0xFFAAAAAA; break; // Light gray
+                case 2: color = 0xFF555555; break; // Dark gray
+                case 3: color = 0xFF000000; break; // Black
+            }
+            int pixel_x = x + col;
+            int pixel_y = y + row;
+            int fb_index = pixel_y * SCREEN_WIDTH + pixel_x;
+            framebuffer[fb_index] = color;
+            }
+            hashLine(y + row);
+        }
+   }
+    
+    const std::array<uint32_t, SCREEN_WIDTH * SCREEN_HEIGHT>& getFramebuffer() {
+        return framebuffer;
+    }
+
+    // Hash of the framebuffer as it is now, folded from the per-line hashes
+    uint64_t getFrameHash() const {
+        return xxhash64(line_hashes.data(), sizeof(line_hashes));
+    }
+
+private:
+    void hashLine(int line) {
+        line_hashes[line] = xxhash64(&framebuffer[line * SCREEN_WIDTH], SCREEN_WIDTH * sizeof(uint32_t));
+    }
+
+    void rehashLines() {
+        for (int line = 0; line < SCREEN_HEIGHT; line++) {
+            hashLine(line);
+        }
+    }
+};
+
+inline uint8_t Memory::readPPU(uint16_t addr) {
+    return ppu->readRegister(addr);
+}
+
+inline void Memory::writePPU(uint16_t addr, uint8_t value) {
+    ppu->writeRegister(addr, value);
+}
+
+inline void Memory::syncPPU() {
+    ppu->catchUp();
+}
+
+inline void Memory::oamChanged() {
+    if (ppu) {
+        ppu->invalidateSprites();
+    }
+}
+
+// Labels from an RGBDS .sym file ("BB:AAAA Name" per line, ';' comments)
+class SymbolTable {
+private:
+    struct Symbol {
+        uint32_t location;  // bank << 16 | address
+        std::string name;
+        bool local;         // "Func.loop" style label inside a function
+    };
+    std::vector<Symbol> symbols;  // Sorted by location
+
+public:
+    // Bank + address packed into one key; RAM and bank 0 use bank 0
+    static uint32_t location(int bank, uint16_t addr) {
+        return ((uint32_t)std::max(bank, 0) << 16) | addr;
+    }
+
+    bool load(const std::string& filename) {
+        std::ifstream file(filename);
+        if (!file) {
+            std::cout << "Could not open symbol file " << filename << std::endl;
+            return false;
+        }
+        std::string line;
+        while (std::getline(file, line)) {
+            line = line.substr(0, line.find(';'));
+            unsigned bank, addr;
+            char name[256];
+            if (std::sscanf(line.c_str(), "%x:%x %255s", &bank, &addr, name) == 3) {
+                symbols.push_back({location(bank, addr), name, std::strchr(name, '.') != nullptr});
+            }
+        }
+        std::sort(symbols.begin(), symbols.end(),
+                  [](const Symbol& a, const Symbol& b) { return a.location < b.location; });
+        std::cout << "Loaded " << symbols.size() << " symbols from " << filename << std::endl;
+        return true;
+    }
+
+    bool empty() const { return symbols.empty(); }
+
+    // Nearest label at or below `loc` in the same bank and 16 KB region, as
+    // "Name+offset"; functions_only gives just the enclosing function's name.
+    // Raw "BB:AAAA" if there is no label.
+    std::string name(uint32_t loc, bool functions_only) const {
+        auto it = std::upper_bound(symbols.begin(), symbols.end(), loc,
+                                   [](uint32_t l, const Symbol& sym) { return l < sym.location; });
+        while (it != symbols.begin()) {
+            --it;
+            if ((it->location & 0xFFFFC000) != (loc & 0xFFFFC000)) {
+                break;
+            }
+            if (functions_only && it->local) {
+                continue;
+            }
+            std::string result = it->name;
+            if (!functions_only && it->location != loc) {
+                char offset[16];
+                std::snprintf(offset, sizeof(offset), "+%X", loc - it->location);
+                result += offset;
+            }
+            return result;
+        }
+        char raw[16];
+        std::snprintf(raw, sizeof(raw), "%02X:%04X", loc >> 16, loc & 0xFFFF);
+        return raw;
+    }
+};
+
+// Samples where the guest is every `interval` cycles: a (bank, PC) histogram
+// plus folded call stacks for flamegraph.pl. The call stack is a shadow of
+// the guest's: a step that pushes a return address (CALL, RST, interrupt)
+// opens a frame, and frames are dropped once SP moves back above them.
+class GuestProfiler {
+private:
+    struct Frame {
+        uint32_t function;  // Call target
+        uint16_t sp;        // SP just after the call pushed its return address
+    };
+    static const size_t MAX_DEPTH = 64;
+
+    int interval;
+    int cycles_until_sample;
+    uint64_t sample_count;
+    std::vector<Frame> stack;
+    std::unordered_map<uint32_t, uint64_t> histogram;
+    std::map<std::vector<uint32_t>, uint64_t> stacks;  // Outermost frame first, sampled location last
+
+    void sample(uint32_t loc) {
+        histogram[loc]++;
+        std::vector<uint32_t> key;
+        key.reserve(stack.size() + 1);
+        for (const Frame& frame : stack) {
+            key.push_back(frame.function);
+        }
+        key.push_back(loc);
+        stacks[key]++;
+        sample_count++;
+    }
+
+public:
+    GuestProfiler(int sample_interval)
+        : interval(std::max(1, sample_interval)), cycles_until_sample(interval), sample_count(0) {}
+
+    // Called after every step with the state before and after it.
+    // `pushed` is the word now at [SP], only looked at if SP dropped by 2.
+    void onStep(int bank, uint16_t pc, uint16_t sp, uint8_t opcode, int cycles,
+                int new_bank, uint16_t new_pc, uint16_t new_sp, uint16_t pushed) {
+        // Frames the guest has returned from (or unwound by hand)
+        while (!stack.empty() && sp > stack.back().sp) {
+            stack.pop_back();
+        }
+
+        cycles_until_sample -= cycles;
+        while (cycles_until_sample <= 0) {
+            sample(SymbolTable::location(bank, pc));
+            cycles_until_sample += interval;
+        }
+
+        if (opcode == 0x31 || opcode == 0xF9) {
+            // LD SP: a new stack, nothing above it is live
+            stack.clear();
+        } else if (new_sp == (uint16_t)(sp - 2) && new_pc != pc + 1 &&
+                   (pushed == pc || pushed == pc + 1 || pushed == pc + 3)) {
+            // A return address was pushed and control moved: CALL, RST or interrupt
+            if (stack.size() < MAX_DEPTH) {
+                stack.push_back({SymbolTable::location(new_bank, new_pc), new_sp});
+            }
+        }
+    }
+
+    uint64_t sampleCount() const { return sample_count; }
+
+    // The guest jumped to another point in time (rewind): none of the
+    // frames on the shadow stack belong to it any more
+    void resetStack() {
+        stack.clear();
+    }
+
+    // One "outer;inner;leaf count" line per distinct stack
+    bool writeFolded(const std::string& filename, const SymbolTable& symbols) const {
+        std::ofstream out(filename);
+        if (!out) {
+            std::cout << "Could not write " << filename << std::endl;
+            return false;
+        }
+        // Stacks that resolve to the same names are merged
+        std::map<std::string, uint64_t> folded;
+        for (const auto& entry : stacks) {
+            const std::vector<uint32_t>& frames = entry.first;
+            std::string line;
+            for (size_t i = 0; i < frames.size(); i++) {
+                if (i > 0) {
+                    line += ';';
+                }
+                // Without symbols the leaf stays a raw PC, otherwise its function
+                bool leaf = i + 1 == frames.size();
+                line += symbols.name(frames[i], !leaf || !symbols.empty());
+            }
+            folded[line] += entry.second;
+        }
+        for (const auto& entry : folded) {
+            out << entry.first << ' ' << entry.second << '\n';
+        }
+        return true;
+    }
+
+    void printTop(size_t count, const SymbolTable& symbols) const {
+        std::vector<std::pair<uint32_t, uint64_t>> sorted(histogram.begin(), histogram.end());
+        std::sort(sorted.begin(), sorted.end(),
+                  [](const std::pair<uint32_t, uint64_t>& a, const std::pair<uint32_t, uint64_t>& b) {
+                      return a.second > b.second;
+                  });
+        std::cout << "Guest profile: " << sample_count << " samples every " << interval << " cycles" << std::endl;
+        for (size_t i = 0; i < std::min(count, sorted.size()); i++) {
+            char line[32];
+            std::snprintf(line, sizeof(line), "%6.2f%%  %02X:%04X  ",
+                          100.0 * sorted[i].second / std::max<uint64_t>(1, sample_count),
+                          sorted[i].first >> 16, sorted[i].first & 0xFFFF);
+            std::cout << line << (symbols.empty() ? "" : symbols.name(sorted[i].first, false)) << std::endl;
+        }
+    }
+};
+
+// Input movie: every button change stamped with the emulated frame and
+// cycle it happened on, plus a hash of every frame so a replay can prove it
+// stayed in sync.
+//
+// File layout (little endian):
+//   "GBMV", version byte, renderer byte (0 scanline, 1 FIFO; from version 2),
+//   ROM hash (u32), frame count (u32), event count (u32)
+//   events: varint frame delta, varint cycle delta, button | pressed << 3
+//   frame hashes: one u32 per frame
+class Movie {
+public:
+    struct InputEvent {
+        uint32_t frame;
+        uint64_t cycle;
+        uint8_t button;
+        bool pressed;
+    };
+
+    uint32_t rom_hash;
+    bool fifo_renderer;   // The renderers draw differently, so hashes depend on it
+    std::vector<InputEvent> events;
+    std::vector<uint32_t> frame_hashes;
+
+    Movie() : rom_hash(0), fifo_renderer(false) {}
+
+    void addInput(uint32_t frame, uint64_t cycle, int button, bool pressed) {
+        events.push_back({frame, cycle, (uint8_t)button, pressed});
+    }
+
+    void addFrame(uint64_t screen_hash) {
+        frame_hashes.push_back(foldHash(screen_hash));
+    }
+
+    static uint32_t foldHash(uint64_t screen_hash) {
+        return (uint32_t)(screen_hash ^ (screen_hash >> 32));
+    }
+
+    // Forget everything from `frame` on (used when rewinding while recording)
+    void truncate(uint32_t frame) {
+        while (!events.empty() && events.back().frame >= frame) {
+            events.pop_back();
+        }
+        if (frame_hashes.size() > frame) {
+            frame_hashes.resize(frame);
+        }
+    }
+
+    bool save(const std::string& filename) const {
+        std::vector<uint8_t> out = {'G', 'B', 'M', 'V', VERSION, (uint8_t)(fifo_renderer ? 1 : 0)};
+        putU32(out, rom_hash);
+        putU32(out, (uint32_t)frame_hashes.size());
+        putU32(out, (uint32_t)events.size());
+
+        uint32_t last_frame = 0;
+        uint64_t last_cycle = 0;
+        for (const InputEvent& event : events) {
+            putVarint(out, event.frame - last_frame);
+            putVarint(out, event.cycle - last_cycle);
+            out.push_back(event.button | (event.pressed ? 0x08 : 0));
+            last_frame = event.frame;
+            last_cycle = event.cycle;
+        }
+        for (uint32_t hash : frame_hashes) {
+            putU32(out, hash);
+        }
+
+        std::ofstream file(filename, std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << "Failed to write movie: " << filename << std::endl;
+            return false;
+        }
+        file.write(reinterpret_cast<const char*>(out.data()), out.size());
+        return file.good();
+    }
+
+    bool load(const std::string& filename) {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << "Failed to open movie: " << filename << std::endl;
+            return false;
+        }
+        std::vector<uint8_t> in((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (in.size() < 17 || std::memcmp(in.data(), "GBMV", 4) != 0 || in[4] < 1 || in[4] > VERSION ||
+            (in[4] >= 2 && in.size() < 18)) {
+            std::cerr << "Not a movie file: " << filename << std::endl;
+            return false;
+        }
+
+        // Version 1 predates the FIFO renderer
+        const uint8_t* p = in.data() + 5;
+        const uint8_t* end = in.data() + in.size();
+        fifo_renderer = in[4] >= 2 && *p++ == 1;
+        rom_hash = getU32(p);
+        uint32_t frame_count = getU32(p);
+        uint32_t event_count = getU32(p);
+
+        events.clear();
+        uint32_t frame = 0;
+        uint64_t cycle = 0;
+        for (uint32_t i = 0; i < event_count; i++) {
+            if (end - p < 3) break;
+            frame += (uint32_t)getVarint(p);
+            cycle += getVarint(p);
+            uint8_t packed = *p++;
+            events.push_back({frame, cycle, (uint8_t)(packed & 0x07), (packed & 0x08) != 0});
+        }
+
+        frame_hashes.clear();
+        for (uint32_t i = 0; i < frame_count && end - p >= 4; i++) {
+            frame_hashes.push_back(getU32(p));
+        }
+        if (events.size() != event_count || frame_hashes.size() != frame_count) {
+            std::cerr << "Truncated movie: " << filename << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static const uint8_t VERSION = 2;
+
+    static void putU32(std::vector<uint8_t>& out, uint32_t value) {
+        for (int i = 0; i < 4; i++) out.push_back((value >> (i * 8)) & 0xFF);
+    }
+
+    static uint32_t getU32(const uint8_t*& p) {
+        uint32_t value = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        p += 4;
+        return value;
+    }
+
+    static void putVarint(std::vector<uint8_t>& out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        out.push_back((uint8_t)value);
+    }
+
+    static uint64_t getVarint(const uint8_t*& p) {
+        uint64_t value = 0;
+        int shift = 0;
+        while (*p & 0x80) {
+            value |= (uint64_t)(*p++ & 0x7F) << shift;
+            shift += 7;
+        }
+        value |= (uint64_t)(*p++) << shift;
+        return value;
+    }
+};
+
+// Memory as the CPU sees it with M-cycle timing: every bus access first
+// runs the APU and scheduled events (PPU modes, timer, DMA) for the 4
+// cycles it takes, so they see mid-instruction effects (e.g. a write to
+// TAC or LYC) at the right time
+class TickingBus {
+private:
+    Memory* memory;
+    APU* apu;
+    Scheduler* scheduler;
+    int ticked;  // Cycles run by accesses since the last takeTicked()
+
+    void tick() {
+        apu->step(4);
+        scheduler->advance(4);
+        ticked += 4;
+    }
+
+public:
+    TickingBus(Memory* mem, APU* a, Scheduler* s)
+        : memory(mem), apu(a), scheduler(s), ticked(0) {}
+
+    uint8_t read(uint16_t addr) {
+        tick();
+        return memory->read(addr);
+    }
+
+    void write(uint16_t addr, uint8_t value) {
+        tick();
+        memory->write(addr, value);
+    }
+
+    uint8_t peek(uint16_t addr) { return memory->peek(addr); }
+    int bankAt(uint16_t addr) const { return memory->bankAt(addr); }
+    uint8_t pendingInterrupts() const { return memory->pendingInterrupts(); }
+    void acknowledgeInterrupt(uint8_t mask) { memory->acknowledgeInterrupt(mask); }
+
+    int takeTicked() {
+        int cycles = ticked;
+        ticked = 0;
+        return cycles;
+    }
+};
+
+// How the rest of the machine keeps up with the CPU
+struct InstructionTiming {};  // After each instruction, by its total cycles (fast)
+struct MCycleTiming {};       // At every memory access, see TickingBus (accurate)
+
+template<class Timing>
+class BasicGameBoy {
+private:
+    static constexpr bool MCYCLE = std::is_same<Timing, MCycleTiming>::value;
+    using Bus = typename std::conditional<MCYCLE, TickingBus, Memory>::type;
+
+    Scheduler scheduler;
+    Memory memory;
+    PPU ppu;
+    Timer timer;
+    APU apu;
+    TickingBus ticking_bus;  // Only used with MCycleTiming
+    BasicCPU<Bus> cpu;
+    std::array<bool, 8> button_states;
+    int audio_cycles;
+    uint64_t total_cycles;   // Emulated cycles since power on
+    uint32_t frame_count;    // Frames completed by runFrame
+    int frame_cycles;        // Cycles run so far by the current runFrame
+    Movie* recording;        // Button changes are logged here when set
+    GuestProfiler* guest_profiler;  // Samples the guest PC when set
+#ifdef GB_INSTRUMENT
+    ExecutionProfile profile;  // Merged into the exit report on destruction
+#endif
+    
+public:
+    static constexpr int CYCLES_PER_FRAME = 70224;
+    static constexpr int CYCLES_PER_SAMPLE = 95;  // 44100 Hz from 4.194 MHz
+
+    // Full machine state (ROM excluded), copied in and out with plain assignments
+    struct Snapshot {
+        Scheduler::State scheduler;
+        Memory::State memory;
+        typename BasicCPU<Bus>::State cpu;
+        PPU::State ppu;
+        Timer::State timer;
+        APU::State apu;
+        std::array<bool, 8> button_states;
+        int audio_cycles;
+        uint64_t total_cycles;
+        uint32_t frame_count;
+    };
+
+    BasicGameBoy()
+        : ppu(&memory, &scheduler), timer(&memory, &scheduler), apu(&memory), ticking_bus(&memory, &apu, &scheduler), cpu(cpuBus()) {
+        button_states.fill(false);
+        audio_cycles = 0;
+        total_cycles = 0;
+        frame_count = 0;
+        frame_cycles = 0;
+        recording = nullptr;
+        guest_profiler = nullptr;
+        memory.setAPU(&apu);
+        memory.setScheduler(&scheduler);
+        memory.setTimer(&timer);
+        memory.setPPU(&ppu);
+#ifdef GB_INSTRUMENT
+        cpu.setProfile(&profile);
+#endif
+    }
+
+    ~BasicGameBoy() {
+#ifdef GB_INSTRUMENT
+        ExecutionReport::get().add(profile);
+#endif
+    }
+    
+    bool loadROM(const std::string& filename) {
+        return memory.loadROM(filename);
+    }
+
+    void loadROM(const ROMImage& image) {
+        memory.setROM(image);
+    }
+
+    // Plain bus read, for tools that inspect RAM (rewards, watches)
+    uint8_t readMemory(uint16_t addr) {
+        return memory.peek(addr);
+    }
+    
+    int step() {
+        if (guest_profiler) {
+            return profiledStep();
+        }
+        return stepMachine();
+    }
+
+    int profiledStep() {
+        uint16_t pc = cpu.getPC();
+        uint16_t sp = cpu.getSP();
+        uint8_t opcode = memory.peek(pc);
+        int bank = memory.bankAt(pc);
+        int cycles = stepMachine();
+        uint16_t new_pc = cpu.getPC();
+        uint16_t new_sp = cpu.getSP();
+        uint16_t pushed = memory.peek(new_sp) | (memory.peek(new_sp + 1) << 8);
+        guest_profiler->onStep(bank, pc, sp, opcode, cycles, memory.bankAt(new_pc), new_pc, new_sp, pushed);
+        return cycles;
+    }
+
+    Bus* cpuBus() {
+        if constexpr (MCYCLE) {
+            return &ticking_bus;
+        } else {
+            return &memory;
+        }
+    }
+
+    // A halted CPU with nothing pending only waits, so instead of stepping
+    // it 4 cycles at a time, jump to the next scheduled event, the only
+    // thing that could wake it. It also stops at the next audio sample and
+    // the end of the frame, so those land where they would have without
+    // the skip.
+    int haltedCycles() const {
+        uint64_t until = scheduler.nextEventTime() - scheduler.getNow();
+        until = std::min<uint64_t>(until, CYCLES_PER_SAMPLE - audio_cycles);
+        until = std::min<uint64_t>(until, std::max(0, CYCLES_PER_FRAME - frame_cycles));
+        return std::max(4, (int)((until + 3) & ~3ull));
+    }
+
+    int stepMachine() {
+        if (cpu.isHalted() && !memory.pendingInterrupts()) {
+            int cycles = haltedCycles();
+            apu.step(cycles);
+            scheduler.advance(cycles);
+            return cycles;
+        }
+#ifdef GB_INSTRUMENT
+        // Only CPU accesses count towards the memory region histogram
+        memory.setProfile(&profile);
+        int cycles = cpu.step();
+        memory.setProfile(nullptr);
+#else
+        int cycles = cpu.step();
+#endif
+        // With M-cycle timing the bus accesses already ran part of it
+        int remaining = cycles;
+        if constexpr (MCYCLE) {
+            remaining -= ticking_bus.takeTicked();
+        }
+        if (remaining > 0) {
+            apu.step(remaining);
+            scheduler.advance(remaining);
+        }
+        return cycles;
+    }
+
+    // Run one frame worth of cycles. Audio samples are appended to audio_out,
+    // or dropped when it is null (e.g. frames that are only run ahead).
+    void runFrame(std::vector<float>* audio_out) {
+        GB_LOG_CLOCK(scheduler.clock());
+        frame_cycles = 0;
+        while (frame_cycles < CYCLES_PER_FRAME) {
+            int cycles = step();
+            frame_cycles += cycles;
+            audio_cycles += cycles;
+            total_cycles += cycles;
+
+            // Generate audio sample every ~95 cycles (44100 Hz from 4.194 MHz)
+            while (audio_cycles >= CYCLES_PER_SAMPLE) {
+                audio_cycles -= CYCLES_PER_SAMPLE;
+                if (audio_out) {
+                    audio_out->push_back(getAudioSample());
+                }
+            }
+        }
+        frame_count++;
+    }
+
+    void saveState(Snapshot& snapshot) const {
+        scheduler.saveState(snapshot.scheduler);
+        memory.saveState(snapshot.memory);
+        cpu.saveState(snapshot.cpu);
+        ppu.saveState(snapshot.ppu);
+        timer.saveState(snapshot.timer);
+        apu.saveState(snapshot.apu);
+        snapshot.button_states = button_states;
+        snapshot.audio_cycles = audio_cycles;
+        snapshot.total_cycles = total_cycles;
+        snapshot.frame_count = frame_count;
+    }
+
+    void loadState(const Snapshot& snapshot) {
+        scheduler.loadState(snapshot.scheduler);
+        memory.loadState(snapshot.memory);
+        cpu.loadState(snapshot.cpu);
+        ppu.loadState(snapshot.ppu);
+        timer.loadState(snapshot.timer);
+        apu.loadState(snapshot.apu);
+        button_states = snapshot.button_states;
+        audio_cycles = snapshot.audio_cycles;
+        total_cycles = snapshot.total_cycles;
+        frame_count = snapshot.frame_count;
+    }
+
+    void setRenderingEnabled(bool enabled) {
+        ppu.setRenderingEnabled(enabled);
+    }
+
+    // Pixel FIFO renderer: accurate mode 3 length and mid-line register
+    // changes, at a cost in speed. The scanline renderer is the default.
+    void setFifoRenderer(bool enabled) {
+        ppu.setFifoRenderer(enabled);
+    }
+
+    // Scanline renderer lines copied from the background row cache / drawn
+    uint64_t getBackgroundRowsReused() const { return ppu.backgroundRowsReused(); }
+    uint64_t getBackgroundRowsDrawn() const { return ppu.backgroundRowsDrawn(); }
+
+    // Run-ahead: emulate the real frame without drawing it, then peek
+    // `frames` frames into the future with the same input and show that
+    // instead. The machine is rolled back afterwards, so game logic only
+    // ever advances by the real frame and the game's own input lag is hidden.
+    // The profiler only sees the real frame: the look-ahead ones are thrown
+    // away and would double its samples and leave calls on its stack.
+    void runFrameAhead(int frames, Snapshot& scratch, std::vector<float>* audio_out) {
+        setRenderingEnabled(false);
+        runFrame(audio_out);
+        saveState(scratch);
+
+        GuestProfiler* profiler = guest_profiler;
+        guest_profiler = nullptr;
+        for (int i = 0; i < frames; i++) {
+            setRenderingEnabled(i == frames - 1);
+            runFrame(nullptr);
+        }
+        // Keep the look-ahead picture, the rest of the machine goes back
+        scratch.ppu.framebuffer = ppu.getFramebuffer();
+        loadState(scratch);
+        guest_profiler = profiler;
+        setRenderingEnabled(true);
+    }
+    
+    const std::array<uint32_t, SCREEN_WIDTH * SCREEN_HEIGHT>& getScreen() {
+        return ppu.getFramebuffer();
+    }
+
+    // Changes exactly when getScreen() does, without rescanning the pixels
+    uint64_t getScreenHash() const {
+        return ppu.getFrameHash();
+    }
+
+    float getAudioSample() {
+        return apu.generateSample();
+    }
+
+    uint32_t romHash() const { return memory.romHash(); }
+    uint32_t getFrameCount() const { return frame_count; }
+    uint64_t getTotalCycles() const { return total_cycles; }
+
+    void setRecording(Movie* movie) { recording = movie; }
+    void setSerialSink(SerialSink* sink) { memory.setSerialSink(sink); }
+    void setGuestProfiler(GuestProfiler* profiler) { guest_profiler = profiler; }
+    void setTrace(TraceRing* ring) { cpu.setTrace(ring, &total_cycles); }
+    bool isCPULocked() const { return cpu.isLocked(); }
+    uint16_t getPC() const { return cpu.getPC(); }
+    uint64_t getInstructionCount() const { return cpu.getInstructionCount(); }
+
+    void setButtonState(int button, bool pressed) {
+        if (recording && pressed != button_states[button]) {
+            recording->addInput(frame_count, total_cycles, button, pressed);
+        }
+        if (pressed && !button_states[button]) {
+            // Button just pressed
+            if (button < 4) {
+                memory.pressButton(button);
+            } else {
+                memory.pressDirection(button - 4);
+            }
+            button_states[button] = true;
+        } else if (!pressed && button_states[button]) {
+            // Button just released
+            if (button < 4) {
+                memory.releaseButton(button);
+            } else {
+                memory.releaseDirection(button - 4);
+            }
+            button_states[button] = false;
+        }
+    }
+
+};
+
+using GameBoy = BasicGameBoy<InstructionTiming>;
+using MCycleGameBoy = BasicGameBoy<MCycleTiming>;
+
+// Rewind history for scrubbing backwards. Every `keyframe_interval` frames a
+// whole snapshot is stored, the frames in between only keep the XOR against
+// the previous frame, run-length encoded. Since XOR works both ways, stepping
+// back is one delta applied to the newest state. Oldest keyframe groups are
+// dropped once the encoded size goes over `budget_bytes`.
+class RewindBuffer {
+private:
+    struct Entry {
+        bool keyframe;
+        std::vector<uint8_t> data;  // RLE of (state XOR previous state), or of the raw state for keyframes
+    };
+
+    static_assert(std::is_trivially_copyable<GameBoy::Snapshot>::value,
+                  "snapshots are diffed as raw bytes");
+    static const size_t STATE_SIZE = sizeof(GameBoy::Snapshot);
+
+    std::deque<Entry> entries;
+    // Zeroed up front so padding and anything saveState skips diff as zeros
+    GameBoy::Snapshot current{};   // State of the newest entry
+    GameBoy::Snapshot scratch{};
+    size_t budget_bytes;
+    size_t used_bytes;
+    int keyframe_interval;
+    int frames_since_keyframe;  // Entries in the newest group, keyframe included
+    uint64_t frames_stored;
+    uint64_t bytes_stored;
+
+    static const uint8_t* bytes(const GameBoy::Snapshot& s) { return reinterpret_cast<const uint8_t*>(&s); }
+    static uint8_t* bytes(GameBoy::Snapshot& s) { return reinterpret_cast<uint8_t*>(&s); }
+
+    static void putVarint(std::vector<uint8_t>& out, size_t value) {
+        while (value >= 0x80) {
+            out.push_back((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        out.push_back((uint8_t)value);
+    }
+
+    static size_t getVarint(const uint8_t*& p) {
+        size_t value = 0;
+        int shift = 0;
+        while (*p & 0x80) {
+            value |= (size_t)(*p++ & 0x7F) << shift;
+            shift += 7;
+        }
+        value |= (size_t)(*p++) << shift;
+        return value;
+    }
+
+    // Encodes a XOR b as (zero run, literal count, literal bytes) tokens.
+    // b == nullptr encodes a on its own.
+    static void encode(const uint8_t* a, const uint8_t* b, std::vector<uint8_t>& out) {
+        out.clear();
+        size_t i = 0;
+        while (i < STATE_SIZE) {
+            size_t zeros_start = i;
+            // Skip unchanged bytes 8 at a time, most of the state is untouched
+            while (i + 8 <= STATE_SIZE) {
+                uint64_t x, y = 0;
+                std::memcpy(&x, a + i, 8);
+                if (b) std::memcpy(&y, b + i, 8);
+                if (x != y) break;
+                i += 8;
+            }
+            while (i < STATE_SIZE && a[i] == (b ? b[i] : 0)) i++;
+            size_t literal_start = i;
+            // A literal run ends at the first pair of unchanged bytes
+            while (i < STATE_SIZE) {
+                uint8_t d = a[i] ^ (b ? b[i] : 0);
+                if (d == 0 && (i + 1 >= STATE_SIZE || a[i + 1] == (b ? b[i + 1] : 0))) break;
+                i++;
+            }
+            putVarint(out, literal_start - zeros_start);
+            putVarint(out, i - literal_start);
+            for (size_t j = literal_start; j < i; j++) {
+                out.push_back(a[j] ^ (b ? b[j] : 0));
+            }
+        }
+    }
+
+    // XORs an encoded entry into state
+    static void apply(uint8_t* state, const std::vector<uint8_t>& data) {
+        const uint8_t* p = data.data();
+        const uint8_t* end = p + data.size();
+        size_t pos = 0;
+        while (p < end) {
+            pos += getVarint(p);
+            size_t literal = getVarint(p);
+            for (size_t j = 0; j < literal; j++) {
+                state[pos++] ^= *p++;
+            }
+        }
+    }
+
+    void dropOldestGroup() {
+        do {
+            used_bytes -= entries.front().data.size();
+            entries.pop_front();
+        } while (!entries.empty() && !entries.front().keyframe);
+    }
+
+public:
+    RewindBuffer(size_t budget, int keyframe_every)
+        : budget_bytes(budget), used_bytes(0),
+          keyframe_interval(std::max(1, keyframe_every)),
+          frames_since_keyframe(0), frames_stored(0), bytes_stored(0) {
+        std::memset(bytes(current), 0, STATE_SIZE);
+        std::memset(bytes(scratch), 0, STATE_SIZE);
+    }
+
+    // Record the state at the end of a frame
+    void push(const GameBoy& gameboy) {
+        gameboy.saveState(scratch);
+
+        Entry entry;
+        entry.keyframe = entries.empty() || frames_since_keyframe >= keyframe_interval;
+        encode(bytes(scratch), entry.keyframe ? nullptr : bytes(current), entry.data);
+        frames_since_keyframe = entry.keyframe ? 1 : frames_since_keyframe + 1;
+
+        used_bytes += entry.data.size();
+        frames_stored++;
+        bytes_stored += entry.data.size();
+        entries.push_back(std::move(entry));
+        std::memcpy(bytes(current), bytes(scratch), STATE_SIZE);  // Padding included
+
+        // Drop whole groups from the old end, never the one being written to
+        while (used_bytes > budget_bytes && entries.size() > (size_t)frames_since_keyframe) {
+            dropOldestGroup();
+        }
+    }
+
+    // Step one frame back. Returns false once the oldest frame is reached.
+    bool rewind(GameBoy& gameboy) {
+        if (entries.size() < 2) {
+            return false;
+        }
+        Entry newest = std::move(entries.back());
+        entries.pop_back();
+        used_bytes -= newest.data.size();
+
+        if (!newest.keyframe) {
+            apply(bytes(current), newest.data);
+            frames_since_keyframe--;
+        } else {
+            // Rebuild from the previous keyframe forward
+            size_t key = entries.size() - 1;
+            while (!entries[key].keyframe) key--;
+            std::memset(bytes(current), 0, STATE_SIZE);
+            for (size_t i = key; i < entries.size(); i++) {
+                apply(bytes(current), entries[i].data);
+            }
+            frames_since_keyframe = (int)(entries.size() - key);
+        }
+
+        gameboy.loadState(current);
+        return true;
+    }
+
+    size_t frameCount() const { return entries.size(); }
+    size_t usedBytes() const { return used_bytes; }
+    double averageBytesPerFrame() const {
+        return frames_stored ? (double)bytes_stored / frames_stored : 0.0;
+    }
+};
+
+
+// Turns the 160x144 ARGB screen into what ML models consume: crop, area
+// averaged downscale, 8-bit grayscale or 2-bit shades (0 = white .. 3 = black,
+// one per byte), and optionally the last `stack` frames oldest first.
+// Grayscale conversion and the vertical filter pass use SSE2/AVX2; the
+// horizontal pass only touches out_w * taps pixels per row and stays scalar.
+class ObservationPipeline {
+public:
+    enum Format {
+        FORMAT_GRAY8 = 1,
+        FORMAT_SHADE2 = 2
+    };
+
+    struct Config {
+        int crop_x, crop_y, crop_w, crop_h;
+        int out_w, out_h;
+        Format format;
+        int stack;
+    };
+
+    static bool validConfig(const Config& c) {
+        return c.crop_x >= 0 && c.crop_y >= 0 && c.crop_w > 0 && c.crop_h > 0 &&
+               c.crop_x + c.crop_w <= SCREEN_WIDTH && c.crop_y + c.crop_h <= SCREEN_HEIGHT &&
+               c.out_w > 0 && c.out_h > 0 && c.out_w <= c.crop_w && c.out_h <= c.crop_h &&
+               c.crop_w <= c.out_w * 7 && c.crop_h <= c.out_h * 7 &&
+               (c.format == FORMAT_GRAY8 || c.format == FORMAT_SHADE2) && c.stack >= 1;
+    }
+
+    explicit ObservationPipeline(const Config& c) : config(c), newest(-1) {
+        std::vector<Taps> cols;
+        buildTaps(config.crop_w, config.out_w, cols);
+        buildTaps(config.crop_h, config.out_h, rows);
+
+        // Horizontal taps flattened to the same count for every column, padded
+        // with zero weights and shifted left where they would run off the row
+        col_taps = 1;
+        for (const Taps& t : cols) col_taps = std::max(col_taps, t.count);
+        col_first.resize(config.out_w);
+        col_weights.assign((size_t)config.out_w * col_taps, 0);
+        for (int ox = 0; ox < config.out_w; ox++) {
+            int first = std::min(cols[ox].first, config.crop_w - col_taps);
+            col_first[ox] = first;
+            for (int t = 0; t < cols[ox].count; t++) {
+                col_weights[ox * col_taps + (cols[ox].first - first) + t] = cols[ox].weight[t];
+            }
+        }
+        frame_size = (size_t)config.out_w * config.out_h;
+        frames.assign(frame_size * config.stack, 0);
+        gray.assign((size_t)config.crop_w * config.crop_h, 0);
+        column.assign(config.crop_w, 0);
+#ifdef GB_X86_SIMD
+        use_avx2 = __builtin_cpu_supports("avx2");
+#endif
+    }
+
+    size_t outputSize() const { return frame_size * config.stack; }
+
+    // Forget stacked history; the next frame fills every slot
+    void reset() { newest = -1; }
+
+    void process(const uint32_t* screen, uint8_t* out) {
+        // Crop + grayscale
+        for (int y = 0; y < config.crop_h; y++) {
+            grayRow(screen + (config.crop_y + y) * SCREEN_WIDTH + config.crop_x,
+                    &gray[(size_t)y * config.crop_w], config.crop_w);
+        }
+
+        int slot = (newest + 1) % config.stack;
+        uint8_t* frame = &frames[slot * frame_size];
+        for (int oy = 0; oy < config.out_h; oy++) {
+            const Taps& taps = rows[oy];
+            verticalPass(taps, column.data());
+
+            uint8_t* out_row = frame + (size_t)oy * config.out_w;
+            horizontalPass(column.data(), out_row);
+            if (config.format == FORMAT_SHADE2) {
+                // 255/170/85/0 are the DMG shades, round to the nearest
+                for (int ox = 0; ox < config.out_w; ox++) {
+                    out_row[ox] = 3 - (out_row[ox] + 42) / 85;
+                }
+            }
+        }
+
+        if (newest < 0) {
+            for (int i = 0; i < config.stack; i++) {
+                if (i != slot) std::memcpy(&frames[i * frame_size], frame, frame_size);
+            }
+        }
+        newest = slot;
+
+        // Oldest first
+        for (int i = 0; i < config.stack; i++) {
+            int from = (newest + 1 + i) % config.stack;
+            std::memcpy(out + i * frame_size, &frames[from * frame_size], frame_size);
+        }
+    }
+
+private:
+    // Source pixels feeding one output pixel; weights are /256 and sum to 256,
+    // so 8-bit pixels can be accumulated in 16 bits without overflow
+    struct Taps {
+        int first;
+        int count;
+        uint16_t weight[8];
+    };
+
+    Config config;
+    std::vector<Taps> rows;
+    int col_taps;
+    std::vector<int> col_first;
+    std::vector<uint16_t> col_weights;  // col_taps per output column
+    size_t frame_size;
+    std::vector<uint8_t> frames;   // Ring of `stack` processed frames
+    int newest;
+    std::vector<uint8_t> gray;     // Cropped grayscale screen
+    std::vector<uint8_t> column;   // One vertically filtered row
+    bool use_avx2 = false;
+
+    // Box filter: output i covers source [i * src / dst, (i + 1) * src / dst)
+    static void buildTaps(int src, int dst, std::vector<Taps>& taps) {
+        taps.resize(dst);
+        for (int i = 0; i < dst; i++) {
+            // Work in 1/dst source pixel units so coverage is exact
+            int start = i * src;
+            int end = (i + 1) * src;
+            Taps& t = taps[i];
+            t.first = start / dst;
+            t.count = 0;
+            int total = 0;
+            for (int j = t.first; j * dst < end && t.count < 8; j++) {
+                int overlap = std::min(end, (j + 1) * dst) - std::max(start, j * dst);
+                t.weight[t.count] = (uint16_t)(overlap * 256 / src);
+                total += t.weight[t.count];
+                t.count++;
+            }
+            // Rounding leftovers go to the largest tap
+            int largest = (int)(std::max_element(t.weight, t.weight + t.count) - t.weight);
+            t.weight[largest] += 256 - total;
+        }
+    }
+
+    void verticalPass(const Taps& taps, uint8_t* dst) {
+        const uint8_t* first = &gray[(size_t)taps.first * config.crop_w];
+        int width = config.crop_w;
+        int x = 0;
+#ifdef GB_X86_SIMD
+        if (use_avx2) {
+            x = verticalPassAVX2(taps, first, dst, width);
+        } else {
+            x = verticalPassSSE2(taps, first, dst, width);
+        }
+#endif
+        for (; x < width; x++) {
+            uint32_t sum = 128;
+            for (int t = 0; t < taps.count; t++) {
+                sum += first[t * width + x] * taps.weight[t];
+            }
+            dst[x] = (uint8_t)(sum >> 8);
+        }
+    }
+
+    // Tap count as a template argument so the inner loop unrolls
+    template <int TAPS>
+    static void horizontalTaps(const uint8_t* src, const int* first, const uint16_t* weights,
+                               uint8_t* dst, int n) {
+        for (int ox = 0; ox < n; ox++) {
+            const uint8_t* p = src + first[ox];
+            const uint16_t* w = weights + ox * TAPS;
+            uint32_t sum = 128;
+            for (int t = 0; t < TAPS; t++) {
+                sum += p[t] * w[t];
+            }
+            dst[ox] = (uint8_t)(sum >> 8);
+        }
+    }
+
+    void horizontalPass(const uint8_t* src, uint8_t* dst) {
+        const int* first = col_first.data();
+        const uint16_t* weights = col_weights.data();
+        int n = config.out_w;
+        switch (col_taps) {
+            case 1: horizontalTaps<1>(src, first, weights, dst, n); break;
+            case 2: horizontalTaps<2>(src, first, weights, dst, n); break;
+            case 3: horizontalTaps<3>(src, first, weights, dst, n); break;
+            case 4: horizontalTaps<4>(src, first, weights, dst, n); break;
+            case 5: horizontalTaps<5>(src, first, weights, dst, n); break;
+            case 6: horizontalTaps<6>(src, first, weights, dst, n); break;
+            case 7: horizontalTaps<7>(src, first, weights, dst, n); break;
+            default: horizontalTaps<8>(src, first, weights, dst, n); break;
+        }
+    }
+
+    void grayRow(const uint32_t* src, uint8_t* dst, int n) {
+        int x = 0;
+#ifdef GB_X86_SIMD
+        if (use_avx2) {
+            x = grayRowAVX2(src, dst, n);
+        } else {
+            x = grayRowSSE2(src, dst, n);
+        }
+#endif
+        for (; x < n; x++) {
+            uint32_t p = src[x];
+            dst[x] = (uint8_t)((((p >> 16) & 0xFF) * 77 + ((p >> 8) & 0xFF) * 150 + (p & 0xFF) * 29 + 128) >> 8);
+        }
+    }
+
+#ifdef GB_X86_SIMD
+    // Luma weights for the B, G, R, A bytes of each pixel (sum 256)
+    static int grayRowSSE2(const uint32_t* src, uint8_t* dst, int n) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i weights = _mm_set_epi16(0, 77, 150, 29, 0, 77, 150, 29);
+        const __m128i half = _mm_set1_epi32(128);
+        int x = 0;
+        for (; x + 4 <= n; x += 4) {
+            __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+            __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(px, zero), weights);
+            __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(px, zero), weights);
+            // B*29+G*150 and R*77 sit in neighbouring lanes, fold them
+            lo = _mm_add_epi32(lo, _mm_srli_epi64(lo, 32));
+            hi = _mm_add_epi32(hi, _mm_srli_epi64(hi, 32));
+            __m128i sums = _mm_unpacklo_epi64(_mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 3, 2, 0)),
+                                              _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 3, 2, 0)));
+            sums = _mm_srli_epi32(_mm_add_epi32(sums, half), 8);
+            sums = _mm_packs_epi32(sums, sums);
+            sums = _mm_packus_epi16(sums, sums);
+            int packed = _mm_cvtsi128_si32(sums);
+            std::memcpy(dst + x, &packed, 4);
+        }
+        return x;
+    }
+
+    __attribute__((target("avx2")))
+    static int grayRowAVX2(const uint32_t* src, uint8_t* dst, int n) {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i weights = _mm256_set_epi16(0, 77, 150, 29, 0, 77, 150, 29,
+                                                 0, 77, 150, 29, 0, 77, 150, 29);
+        const __m256i half = _mm256_set1_epi32(128);
+        int x = 0;
+        for (; x + 8 <= n; x += 8) {
+            __m256i px = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x));
+            __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(px, zero), weights);
+            __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(px, zero), weights);
+            lo = _mm256_add_epi32(lo, _mm256_srli_epi64(lo, 32));
+            hi = _mm256_add_epi32(hi, _mm256_srli_epi64(hi, 32));
+            // Per 128-bit lane this gives pixels 0-3 and 4-7 in order
+            __m256i sums = _mm256_unpacklo_epi64(_mm256_shuffle_epi32(lo, _MM_SHUFFLE(3, 3, 2, 0)),
+                                                 _mm256_shuffle_epi32(hi, _MM_SHUFFLE(3, 3, 2, 0)));
+            sums = _mm256_srli_epi32(_mm256_add_epi32(sums, half), 8);
+            sums = _mm256_packs_epi32(sums, sums);
+            sums = _mm256_packus_epi16(sums, sums);
+            int first = _mm_cvtsi128_si32(_mm256_castsi256_si128(sums));
+            int second = _mm_cvtsi128_si32(_mm256_extracti128_si256(sums, 1));
+            std::memcpy(dst + x, &first, 4);
+            std::memcpy(dst + x + 4, &second, 4);
+        }
+        return x;
+    }
+
+    static int verticalPassSSE2(const Taps& taps, const uint8_t* first, uint8_t* dst, int width) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i half = _mm_set1_epi16(128);
+        int x = 0;
+        for (; x + 8 <= width; x += 8) {
+            __m128i acc = half;
+            for (int t = 0; t < taps.count; t++) {
+                __m128i px = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(first + t * width + x));
+                acc = _mm_add_epi16(acc, _mm_mullo_epi16(_mm_unpacklo_epi8(px, zero),
+                                                         _mm_set1_epi16(taps.weight[t])));
+            }
+            acc = _mm_srli_epi16(acc, 8);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(acc, acc));
+        }
+        return x;
+    }
+
+    __attribute__((target("avx2")))
+    static int verticalPassAVX2(const Taps& taps, const uint8_t* first, uint8_t* dst, int width) {
+        const __m256i half = _mm256_set1_epi16(128);
+        int x = 0;
+        for (; x + 16 <= width; x += 16) {
+            __m256i acc = half;
+            for (int t = 0; t < taps.count; t++) {
+                __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first + t * width + x));
+                acc = _mm256_add_epi16(acc, _mm256_mullo_epi16(_mm256_cvtepu8_epi16(px),
+                                                               _mm256_set1_epi16(taps.weight[t])));
+            }
+            acc = _mm256_srli_epi16(acc, 8);
+            __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), packed);
+        }
+        return x;
+    }
+#endif
+};
+
+// Many copies of one ROM stepped in lockstep for RL. Each step applies one
+// action byte per env (bit i = setButtonState button i), runs
+// `frames_per_step` frames, then writes the observations (raw ARGB screens,
+// or the output of an ObservationPipeline) into one contiguous caller-owned
+// buffer and the bytes at the reward addresses into another.
+// Envs are split into fixed ranges, one per thread; the calling thread
+// works on the first range. Nothing is allocated per step.
+class VecEnv {
+public:
+    static const int OBSERVATION_PIXELS = SCREEN_WIDTH * SCREEN_HEIGHT;
+
+    VecEnv(const ROMImage& rom, int num_envs, int num_threads,
+           const std::vector<uint16_t>& reward_addresses, int frames_per_step)
+        : reward_addrs(reward_addresses), frames_per_step(std::max(1, frames_per_step)),
+          job_actions(nullptr), job_observations(nullptr), job_rewards(nullptr), job_reset(false),
+          generation(0), busy_workers(0), stopping(false) {
+        for (int i = 0; i < num_envs; i++) {
+            envs.emplace_back(new GameBoy());
+            envs.back()->loadROM(rom);
+        }
+        initial_state.reset(new GameBoy::Snapshot());
+        if (!envs.empty()) {
+            envs[0]->saveState(*initial_state);
+        }
+
+        if (num_threads <= 0) {
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        num_threads = std::max(1, std::min(num_threads, num_envs));
+        for (int t = 0; t <= num_threads; t++) {
+            range_starts.push_back((int)((int64_t)t * num_envs / num_threads));
+        }
+        for (int t = 1; t < num_threads; t++) {
+            workers.emplace_back(&VecEnv::workerLoop, this, t);
+        }
+    }
+
+    ~VecEnv() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    int size() const { return (int)envs.size(); }
+    int rewardCount() const { return (int)reward_addrs.size(); }
+    int threadCount() const { return (int)workers.size() + 1; }
+
+    // Bytes of observation written per env
+    size_t observationSize() const {
+        return pipelines.empty() ? OBSERVATION_PIXELS * sizeof(uint32_t) : pipelines[0].outputSize();
+    }
+
+    // Switch every env to a processed observation, or back to raw ARGB with
+    // null. Not to be called while a step is running.
+    bool setObservation(const ObservationPipeline::Config* config) {
+        pipelines.clear();
+        if (!config) {
+            return true;
+        }
+        if (!ObservationPipeline::validConfig(*config)) {
+            return false;
+        }
+        for (size_t i = 0; i < envs.size(); i++) {
+            pipelines.emplace_back(*config);
+        }
+        return true;
+    }
+
+    // Pixel FIFO or scanline renderer for every env. Not to be called
+    // while a step is running.
+    void setFifoRenderer(bool enabled) {
+        for (auto& gameboy : envs) {
+            gameboy->setFifoRenderer(enabled);
+        }
+    }
+
+    // Back to the power-on state; observations may be null
+    void reset(void* observations) {
+        run(nullptr, observations, nullptr, true);
+    }
+
+    // observations: size() * observationSize() bytes
+    // rewards: size() * rewardCount() bytes (may be null)
+    void step(const uint8_t* actions, void* observations, uint8_t* rewards) {
+        run(actions, observations, rewards, false);
+    }
+
+private:
+    std::vector<std::unique_ptr<GameBoy>> envs;
+    std::unique_ptr<GameBoy::Snapshot> initial_state;
+    std::vector<uint16_t> reward_addrs;
+    int frames_per_step;
+    std::vector<ObservationPipeline> pipelines;  // One per env (own frame stack), or empty for raw ARGB
+    std::vector<int> range_starts;   // Env range of thread t is [range_starts[t], range_starts[t + 1])
+    std::vector<std::thread> workers;
+
+    // Current job, published under `mutex`
+    const uint8_t* job_actions;
+    uint8_t* job_observations;
+    uint8_t* job_rewards;
+    bool job_reset;
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    uint64_t generation;
+    int busy_workers;
+    bool stopping;
+
+    void run(const uint8_t* actions, void* observations, uint8_t* rewards, bool reset) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job_actions = actions;
+            job_observations = static_cast<uint8_t*>(observations);
+            job_rewards = rewards;
+            job_reset = reset;
+            busy_workers = (int)workers.size();
+            generation++;
+        }
+        work_ready.notify_all();
+
+        runRange(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        work_done.wait(lock, [this] { return busy_workers == 0; });
+    }
+
+    void workerLoop(int thread_index) {
+        uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_ready.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+
+            runRange(thread_index);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy_workers == 0) {
+                work_done.notify_one();
+            }
+        }
+    }
+
+    void runRange(int thread_index) {
+        for (int i = range_starts[thread_index]; i < range_starts[thread_index + 1]; i++) {
+            GameBoy& gameboy = *envs[i];
+
+            if (job_reset) {
+                gameboy.loadState(*initial_state);
+                if (!pipelines.empty()) {
+                    pipelines[i].reset();
+                }
+            } else {
+                uint8_t action = job_actions[i];
+                for (int button = 0; button < 8; button++) {
+                    gameboy.setButtonState(button, (action >> button) & 1);
+                }
+                for (int frame = 0; frame < frames_per_step; frame++) {
+                    gameboy.runFrame(nullptr);
+                }
+            }
+
+            if (job_observations) {
+                uint8_t* out = job_observations + i * observationSize();
+                if (pipelines.empty()) {
+                    std::memcpy(out, gameboy.getScreen().data(), OBSERVATION_PIXELS * sizeof(uint32_t));
+                } else {
+                    pipelines[i].process(gameboy.getScreen().data(), out);
+                }
+            }
+            if (job_rewards) {
+                uint8_t* out = job_rewards + (size_t)i * reward_addrs.size();
+                for (size_t r = 0; r < reward_addrs.size(); r++) {
+                    out[r] = gameboy.readMemory(reward_addrs[r]);
+                }
+            }
+        }
+    }
+};
+
+// C API over VecEnv, built into the shared library with -DGB_LIBRARY:
+//
+//   typedef struct gb_vec_env gb_vec_env;
+//   gb_vec_env* gb_vec_create(const char* rom_path, int num_envs, int num_threads,
+//                             const uint16_t* reward_addrs, int num_reward_addrs,
+//                             int frames_per_step);
+//   int gb_vec_set_observation(gb_vec_env* env, int crop_x, int crop_y, int crop_w, int crop_h,
+//                              int out_w, int out_h, int format, int stack);
+//   void gb_vec_set_renderer(gb_vec_env* env, int fifo);
+//   void gb_vec_reset(gb_vec_env* env, void* observations);
+//   void gb_vec_step(gb_vec_env* env, const uint8_t* actions,
+//                    void* observations, uint8_t* rewards);
+//   void gb_vec_destroy(gb_vec_env* env);
+//
+// observations holds num_envs * 160 * 144 ARGB pixels by default. After
+// gb_vec_set_observation (format 1 = 8-bit gray, 2 = 2-bit shades, 0 = back
+// to ARGB) it holds num_envs times the returned byte count, -1 meaning the
+// config was rejected. rewards holds num_envs * num_reward_addrs bytes.
+// gb_vec_set_renderer(env, 1) draws with the pixel FIFO renderer, for games
+// that change registers mid-line; 0 is the faster scanline renderer.
+// num_threads <= 0 uses every core.
+#if defined(_WIN32)
+#define GB_API __declspec(dllexport)
+#else
+#define GB_API __attribute__((visibility("default")))
+#endif
+
+extern "C" {
+
+GB_API VecEnv* gb_vec_create(const char* rom_path, int num_envs, int num_threads,
+                             const uint16_t* reward_addrs, int num_reward_addrs,
+                             int frames_per_step) {
+    ROMImage rom = Memory::readROMFile(rom_path);
+    if (!rom || num_envs <= 0) {
+        return nullptr;
+    }
+    std::vector<uint16_t> addrs;
+    if (reward_addrs && num_reward_addrs > 0) {
+        addrs.assign(reward_addrs, reward_addrs + num_reward_addrs);
+    }
+    return new VecEnv(rom, num_envs, num_threads, addrs, frames_per_step);
+}
+
+GB_API int gb_vec_set_observation(VecEnv* env, int crop_x, int crop_y, int crop_w, int crop_h,
+                                  int out_w, int out_h, int format, int stack) {
+    if (format == 0) {
+        env->setObservation(nullptr);
+        return (int)env->observationSize();
+    }
+    ObservationPipeline::Config config = {crop_x, crop_y, crop_w, crop_h, out_w, out_h,
+                                          (ObservationPipeline::Format)format, stack};
+    if (!env->setObservation(&config)) {
+        return -1;
+    }
+    return (int)env->observationSize();
+}
+
+GB_API void gb_vec_set_renderer(VecEnv* env, int fifo) {
+    env->setFifoRenderer(fifo != 0);
+}
+
+GB_API void gb_vec_reset(VecEnv* env, void* observations) {
+    env->reset(observations);
+}
+
+GB_API void gb_vec_step(VecEnv* env, const uint8_t* actions, void* observations, uint8_t* rewards) {
+    env->step(actions, observations, rewards);
+}
+
+GB_API void gb_vec_destroy(VecEnv* env) {
+    delete env;
+}
+
+}
+
+// CPU pixel-art upscaling for the display, for machines where SDL's own
+// scaling is all there is. submit() copies a frame in and returns at once;
+// worker threads scale it in bands of rows while emulation goes on, and
+// wait() hands back the result. Scale2x, Scale3x and the LCD grid run four
+// pixels at a time with SSE2. HQ2x and xBR are reduced to their 3x3 corner
+// rules (enough for four shades of gray) and stay scalar.
+class Upscaler {
+public:
+    enum Filter {
+        NONE,
+        SCALE2X,   // AdvMAME2x edge rules
+        SCALE3X,   // AdvMAME3x edge rules
+        HQ2X,      // Scale2x corners blended with both edge neighbours
+        XBR,       // xBR level 1 corner test on a 3x3 window, blended 1:1
+        LCD_GRID   // 4x blocks with a darker right column and bottom row
+    };
+
+    static bool parseFilter(const std::string& name, Filter& filter) {
+        static const std::pair<const char*, Filter> names[] = {
+            {"none", NONE}, {"scale2x", SCALE2X}, {"scale3x", SCALE3X},
+            {"hq2x", HQ2X}, {"xbr", XBR}, {"lcd", LCD_GRID}};
+        for (const auto& entry : names) {
+            if (name == entry.first) {
+                filter = entry.second;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static int factor(Filter filter) {
+        switch (filter) {
+            case SCALE3X:  return 3;
+            case LCD_GRID: return SCALE;
+            case NONE:     return 1;
+            default:       return 2;
+        }
+    }
+
+    Upscaler(Filter f, int num_threads)
+        : filter(f), scale(factor(f)), generation(0), busy_workers(0), stopping(false),
+          total_ms(0.0), frames(0) {
+        padded.assign(PADDED_WIDTH * (SCREEN_HEIGHT + 2), 0);
+        output.assign((size_t)width() * height(), 0);
+        if (num_threads <= 0) {
+            num_threads = std::max(1, std::min(4, (int)std::thread::hardware_concurrency() - 1));
+        }
+        num_threads = std::min(num_threads, SCREEN_HEIGHT);
+        for (int t = 0; t <= num_threads; t++) {
+            band_starts.push_back(t * SCREEN_HEIGHT / num_threads);
+        }
+        for (int t = 0; t < num_threads; t++) {
+            workers.emplace_back(&Upscaler::workerLoop, this, t);
+        }
+    }
+
+    ~Upscaler() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    int width() const { return SCREEN_WIDTH * scale; }
+    int height() const { return SCREEN_HEIGHT * scale; }
+    int threadCount() const { return (int)workers.size(); }
+
+    // Wall time from submit() until the last band is done, averaged
+    double averageMilliseconds() const { return frames ? total_ms / frames : 0.0; }
+
+    // Start scaling a 160x144 frame. The previous one must have been waited for.
+    void submit(const uint32_t* frame) {
+        // One pixel of replicated border, so no kernel needs edge cases
+        for (int y = 0; y < SCREEN_HEIGHT; y++) {
+            uint32_t* row = &padded[(y + 1) * PADDED_WIDTH];
+            std::memcpy(row + 1, frame + y * SCREEN_WIDTH, SCREEN_WIDTH * sizeof(uint32_t));
+            row[0] = row[1];
+            row[SCREEN_WIDTH + 1] = row[SCREEN_WIDTH];
+        }
+        std::memcpy(&padded[0], &padded[PADDED_WIDTH], PADDED_WIDTH * sizeof(uint32_t));
+        std::memcpy(&padded[(SCREEN_HEIGHT + 1) * PADDED_WIDTH], &padded[SCREEN_HEIGHT * PADDED_WIDTH],
+                    PADDED_WIDTH * sizeof(uint32_t));
+
+        std::lock_guard<std::mutex> lock(mutex);
+        submitted = std::chrono::steady_clock::now();
+        busy_workers = (int)workers.size();
+        generation++;
+        work_ready.notify_all();
+    }
+
+    // The scaled frame, width() x height() ARGB, once every band is done
+    const uint32_t* wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        work_done.wait(lock, [this] { return busy_workers == 0; });
+        return output.data();
+    }
+
+private:
+    static constexpr int PADDED_WIDTH = SCREEN_WIDTH + 2;
+    static_assert(SCREEN_WIDTH % 4 == 0, "the SSE2 kernels take 4 pixels at a time");
+
+    Filter filter;
+    int scale;
+    std::vector<uint32_t> padded;   // Input with a 1 pixel border
+    std::vector<uint32_t> output;
+    std::vector<int> band_starts;   // Rows of thread t are [band_starts[t], band_starts[t + 1])
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    uint64_t generation;
+    int busy_workers;
+    bool stopping;
+    std::chrono::steady_clock::time_point submitted;
+    double total_ms;
+    uint64_t frames;
+
+    void workerLoop(int thread_index) {
+        uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_ready.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+
+            for (int y = band_starts[thread_index]; y < band_starts[thread_index + 1]; y++) {
+                scaleRow(y);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy_workers == 0) {
+                total_ms += std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - submitted).count();
+                frames++;
+                work_done.notify_all();
+            }
+        }
+    }
+
+    // Source row y and the rows above and below it, at x = 0
+    const uint32_t* source(int y) const { return &padded[(y + 1) * PADDED_WIDTH + 1]; }
+
+    void scaleRow(int y) {
+        uint32_t* out = &output[(size_t)y * scale * width()];
+        switch (filter) {
+            case SCALE2X:  scale2xRow(source(y - 1), source(y), source(y + 1), out, width()); break;
+            case SCALE3X:  scale3xRow(source(y - 1), source(y), source(y + 1), out, width()); break;
+            case HQ2X:     hq2xRow(source(y - 1), source(y), source(y + 1), out, width()); break;
+            case XBR:      xbrRow(source(y - 1), source(y), source(y + 1), out, width()); break;
+            case LCD_GRID: lcdGridRow(source(y), out, width()); break;
+            case NONE:     std::memcpy(out, source(y), SCREEN_WIDTH * sizeof(uint32_t)); break;
+        }
+    }
+
+    static uint32_t average(uint32_t a, uint32_t b) {
+        return (((a ^ b) & 0xFEFEFEFE) >> 1) + (a & b);
+    }
+
+    // Sum of the per-channel differences
+    static int distance(uint32_t a, uint32_t b) {
+        return std::abs((int)((a >> 16) & 0xFF) - (int)((b >> 16) & 0xFF)) +
+               std::abs((int)((a >> 8) & 0xFF) - (int)((b >> 8) & 0xFF)) +
+               std::abs((int)(a & 0xFF) - (int)(b & 0xFF));
+    }
+
+    // 75% brightness, alpha kept
+    static uint32_t darken(uint32_t p) {
+        return p - ((p >> 2) & 0x003F3F3F);
+    }
+
+    // Neighbours of E:  A B C
+    //                   D E F
+    //                   G H I
+    static void scale2xRow(const uint32_t* up, const uint32_t* mid, const uint32_t* down,
+                           uint32_t* out, int out_width) {
+        uint32_t* out0 = out;
+        uint32_t* out1 = out + out_width;
+#ifdef GB_X86_SIMD
+        for (int x = 0; x < SCREEN_WIDTH; x += 4) {
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(up + x));
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mid + x - 1));
+            __m128i e = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mid + x));
+            __m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mid + x + 1));
+            __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(down + x));
+            // Only where B != H and D != F
+            __m128i edge = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi32(b, h), _mm_cmpeq_epi32(d, f)),
+                                            _mm_set1_epi32(-1));
+            __m128i e0 = select(_mm_and_si128(edge, _mm_cmpeq_epi32(d, b)), d, e);
+            __m128i e1 = select(_mm_and_si128(edge, _mm_cmpeq_epi32(b, f)), f, e);
+            __m128i e2 = select(_mm_and_si128(edge, _mm_cmpeq_epi32(d, h)), d, e);
+            __m128i e3 = select(_mm_and_si128(edge, _mm_cmpeq_epi32(h, f)), f, e);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out0 + 2 * x), _mm_unpacklo_epi32(e0, e1));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out0 + 2 * x + 4), _mm_unpackhi_epi32(e0, e1));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out1 + 2 * x), _mm_unpacklo_epi32(e2, e3));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out1 + 2 * x + 4), _mm_unpackhi_epi32(e2, e3));
+        }
+#else
+        for (int x = 0; x < SCREEN_WIDTH; x++) {
+            uint32_t b = up[x], d = mid[x - 1], e = mid[x], f = mid[x + 1], h = down[x];
+            bool edge = b != h && d != f;
+            out0[2 * x] = edge && d == b ? d : e;
+            out0[2 * x + 1] = edge && b == f ? f : e;
+            out1[2 * x] = edge && d == h ? d : e;
+            out1[2 * x + 1] = edge && h == f ? f : e;
+        }
+#endif
+    }
+
+    static void scale3xRow(const uint32_t* up, const uint32_t* mid, const uint32_t* down,
+                           uint32_t* out, int out_width) {
+        uint32_t* rows[3] = {out, out + out_width, out + 2 * out_width};
+#ifdef GB_X86_SIMD
+        // The rules vectorize; the 3-way interleave goes through a small buffer
+        alignas(16) uint32_t pixels[9][4];
+        for (int x = 0; x < SCREEN_WIDTH; x += 4) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(up + x - 1));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(up + x));
+            __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(up + x + 1));
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mid + x - 1));
+            __m128i e = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mid + x));
+            __m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mid + x + 1));
+            __m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i*>(down + x - 1));
+            __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(down + x));
+            __m128i i = _mm_loadu_si128(reinterpret_cast<const __m128i*>(down + x + 1));
+            __m128i all = _mm_set1_epi32(-1);
+            __m128i edge = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi32(b, h), _mm_cmpeq_epi32(d, f)), all);
+            __m128i db = _mm_and_si128(edge, _mm_cmpeq_epi32(d, b));
+            __m128i bf = _mm_and_si128(edge, _mm_cmpeq_epi32(b, f));
+            __m128i dh = _mm_and_si128(edge, _mm_cmpeq_epi32(d, h));
+            __m128i hf = _mm_and_si128(edge, _mm_cmpeq_epi32(h, f));
+            // ea = E != A and so on
+            __m128i ea = _mm_andnot_si128(_mm_cmpeq_epi32(e, a), all);
+            __m128i ec = _mm_andnot_si128(_mm_cmpeq_epi32(e, c), all);
+            __m128i eg = _mm_andnot_si128(_mm_cmpeq_epi32(e, g), all);
+            __m128i ei = _mm_andnot_si128(_mm_cmpeq_epi32(e, i), all);
+            __m128i result[9] = {
+                select(db, d, e),
+                select(_mm_or_si128(_mm_and_si128(db, ec), _mm_and_si128(bf, ea)), b, e),
+                select(bf, f, e),
+                select(_mm_or_si128(_mm_and_si128(db, eg), _mm_and_si128(dh, ea)), d, e),
+                e,
+                select(_mm_or_si128(_mm_and_si128(bf, ei), _mm_and_si128(hf, ec)), f, e),
+                select(dh, d, e),
+                select(_mm_or_si128(_mm_and_si128(dh, ei), _mm_and_si128(hf, eg)), h, e),
+                select(hf, f, e)};
+            for (int k = 0; k < 9; k++) {
+                _mm_store_si128(reinterpret_cast<__m128i*>(pixels[k]), result[k]);
+            }
+            for (int lane = 0; lane < 4; lane++) {
+                for (int k = 0; k < 9; k++) {
+                    rows[k / 3][3 * (x + lane) + k % 3] = pixels[k][lane];
+                }
+            }
+        }
+#else
+        for (int x = 0; x < SCREEN_WIDTH; x++) {
+            uint32_t a = up[x - 1], b = up[x], c = up[x + 1];
+            uint32_t d = mid[x - 1], e = mid[x], f = mid[x + 1];
+            uint32_t g = down[x - 1], h = down[x], i = down[x + 1];
+            uint32_t result[9] = {e, e, e, e, e, e, e, e, e};
+            if (b != h && d != f) {
+                result[0] = d == b ? d : e;
+                result[1] = (d == b && e != c) || (b == f && e != a) ? b : e;
+                result[2] = b == f ? f : e;
+                result[3] = (d == b && e != g) || (d == h && e != a) ? d : e;
+                result[5] = (b == f && e != i) || (h == f && e != c) ? f : e;
+                result[6] = d == h ? d : e;
+                result[7] = (d == h && e != i) || (h == f && e != g) ? h : e;
+                result[8] = h == f ? f : e;
+            }
+            for (int k = 0; k < 9; k++) {
+                rows[k / 3][3 * x + k % 3] = result[k];
+            }
+        }
+#endif
+    }
+
+    // Scale2x's corner test, but the corner becomes (2E + both edge pixels) / 4
+    // instead of a hard copy, which softens the staircase
+    static void hq2xRow(const uint32_t* up, const uint32_t* mid, const uint32_t* down,
+                        uint32_t* out, int out_width) {
+        uint32_t* out0 = out;
+        uint32_t* out1 = out + out_width;
+        for (int x = 0; x < SCREEN_WIDTH; x++) {
+            uint32_t b = up[x], d = mid[x - 1], e = mid[x], f = mid[x + 1], h = down[x];
+            bool edge = b != h && d != f;
+            out0[2 * x] = edge && d == b ? average(e, average(b, d)) : e;
+            out0[2 * x + 1] = edge && b == f ? average(e, average(b, f)) : e;
+            out1[2 * x] = edge && d == h ? average(e, average(d, h)) : e;
+            out1[2 * x + 1] = edge && h == f ? average(e, average(h, f)) : e;
+        }
+    }
+
+    // One xBR corner: E's corner between `p` and `q` (the pixels beside it,
+    // `r` diagonally across) is blended when the edge along p-q is weaker
+    // than the one through E and r. p_far/q_far are p's and q's other
+    // neighbours away from the corner, side1/side2 E's diagonal neighbours
+    // off the corner's axis.
+    static uint32_t xbrCorner(uint32_t e, uint32_t p, uint32_t q, uint32_t r,
+                              uint32_t p_far, uint32_t q_far, uint32_t e_side1, uint32_t e_side2) {
+        int along = distance(e, e_side1) + distance(e, e_side2) + 4 * distance(p, q);
+        int across = distance(p, p_far) + distance(q, q_far) + 4 * distance(e, r);
+        if (along >= across) {
+            return e;
+        }
+        return average(e, distance(e, p) <= distance(e, q) ? p : q);
+    }
+
+    static void xbrRow(const uint32_t* up, const uint32_t* mid, const uint32_t* down,
+                       uint32_t* out, int out_width) {
+        uint32_t* out0 = out;
+        uint32_t* out1 = out + out_width;
+        for (int x = 0; x < SCREEN_WIDTH; x++) {
+            uint32_t a = up[x - 1], b = up[x], c = up[x + 1];
+            uint32_t d = mid[x - 1], e = mid[x], f = mid[x + 1];
+            uint32_t g = down[x - 1], h = down[x], i = down[x + 1];
+            out0[2 * x] = xbrCorner(e, b, d, a, f, h, c, g);
+            out0[2 * x + 1] = xbrCorner(e, b, f, c, d, h, a, i);
+            out1[2 * x] = xbrCorner(e, h, d, g, f, b, a, i);
+            out1[2 * x + 1] = xbrCorner(e, h, f, i, d, b, c, g);
+        }
+    }
+
+    static void lcdGridRow(const uint32_t* mid, uint32_t* out, int out_width) {
+#ifdef GB_X86_SIMD
+        static_assert(SCALE == 4, "one SSE2 store per 4x1 run of a block");
+        const __m128i last_lane = _mm_set_epi32(-1, 0, 0, 0);
+        const __m128i channels = _mm_set1_epi32(0x003F3F3F);
+        for (int x = 0; x < SCREEN_WIDTH; x += 4) {
+            __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mid + x));
+            __m128i dark = _mm_sub_epi32(p, _mm_and_si128(_mm_srli_epi32(p, 2), channels));
+            __m128i blocks[4] = {_mm_shuffle_epi32(p, 0x00), _mm_shuffle_epi32(p, 0x55),
+                                 _mm_shuffle_epi32(p, 0xAA), _mm_shuffle_epi32(p, 0xFF)};
+            __m128i dark_blocks[4] = {_mm_shuffle_epi32(dark, 0x00), _mm_shuffle_epi32(dark, 0x55),
+                                      _mm_shuffle_epi32(dark, 0xAA), _mm_shuffle_epi32(dark, 0xFF)};
+            for (int k = 0; k < 4; k++) {
+                __m128i lit = select(last_lane, dark_blocks[k], blocks[k]);
+                for (int row = 0; row < SCALE - 1; row++) {
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + row * out_width + SCALE * (x + k)), lit);
+                }
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + (SCALE - 1) * out_width + SCALE * (x + k)),
+                                 dark_blocks[k]);
+            }
+        }
+#else
+        for (int x = 0; x < SCREEN_WIDTH; x++) {
+            uint32_t dark = darken(mid[x]);
+            for (int row = 0; row < SCALE; row++) {
+                for (int col = 0; col < SCALE; col++) {
+                    bool gap = row == SCALE - 1 || col == SCALE - 1;
+                    out[row * out_width + SCALE * x + col] = gap ? dark : mid[x];
+                }
+            }
+        }
+#endif
+    }
+
+#ifdef GB_X86_SIMD
+    // mask ? a : b, per 32-bit lane
+    static __m128i select(__m128i mask, __m128i a, __m128i b) {
+        return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+    }
+#endif
+};
+
+// Headless capture of what the machine shows and plays, for encoding
+// offline. push() copies a frame and its audio into one slot of a fixed ring
+// and returns; a writer thread converts and writes them, so the emulation
+// thread never waits on the disk or on a pipe's reader. When the ring is full
+// the frame is dropped rather than waited for: its audio is carried into the
+// next slot (up to a second of it, silence beyond that) and the writer
+// repeats the last picture in its place, so video and audio stay in step.
+// Headless replays have no deadline and set blocking mode instead, where
+// push() waits for a free slot and nothing is dropped.
+//
+// Video is Y4M (4:4:4, 160x144 at 4194304/70224 fps) for *.y4m, raw RGB24
+// otherwise. Audio is 16-bit mono WAV for *.wav, raw float32 otherwise. Named
+// pipes work as file names; a WAV header written to one keeps its
+// placeholder sizes, which ffmpeg accepts.
+class CaptureSink {
+public:
+    static constexpr int QUEUE_FRAMES = 64;           // About a second
+    static constexpr int SAMPLE_RATE = 44100;
+    static constexpr size_t MAX_CARRIED_SAMPLES = SAMPLE_RATE;  // Audio kept across drops
+
+    CaptureSink() : video(nullptr), audio(nullptr), y4m(false), wav(false), head(0), count(0),
+                    stopping(false), frames_written(0), frames_dropped(0), samples_written(0),
+                    carried_drops(0), carried_silence(0), blocking(false) {}
+
+    ~CaptureSink() {
+        close();
+    }
+
+    // Either file name may be empty
+    bool open(const std::string& video_file, const std::string& audio_file) {
+        if (!video_file.empty()) {
+            video = std::fopen(video_file.c_str(), "wb");
+            if (!video) {
+                std::cout << "Could not write " << video_file << std::endl;
+                return false;
+            }
+            y4m = endsWith(video_file, ".y4m");
+            if (y4m) {
+                std::fprintf(video, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C444\n", SCREEN_WIDTH, SCREEN_HEIGHT,
+                             CPU_FREQUENCY, GameBoy::CYCLES_PER_FRAME);
+            }
+        }
+        if (!audio_file.empty()) {
+            audio = std::fopen(audio_file.c_str(), "wb");
+            if (!audio) {
+                std::cout << "Could not write " << audio_file << std::endl;
+                close();
+                return false;
+            }
+            wav = endsWith(audio_file, ".wav");
+            if (wav) {
+                writeWAVHeader(0xFFFFFFFF);
+            }
+        }
+        slots.resize(QUEUE_FRAMES);
+        for (Slot& slot : slots) {
+            slot.frame.resize(SCREEN_WIDTH * SCREEN_HEIGHT);
+            slot.audio.reserve(2048);
+        }
+        writer = std::thread(&CaptureSink::writerLoop, this);
+        return true;
+    }
+
+    bool isOpen() const { return writer.joinable(); }
+
+    // Wait for the writer when the queue is full instead of dropping
+    void setBlocking(bool enabled) { blocking = enabled; }
+
+    // Queue one frame and the samples generated during it
+    void push(const uint32_t* frame, const std::vector<float>& samples) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (blocking) {
+            space_ready.wait(lock, [this] { return count < QUEUE_FRAMES; });
+        }
+        if (count == QUEUE_FRAMES) {
+            frames_dropped++;
+            carried_drops++;
+            size_t room = MAX_CARRIED_SAMPLES - std::min(MAX_CARRIED_SAMPLES, carried_audio.size());
+            size_t kept = std::min(room, samples.size());
+            carried_audio.insert(carried_audio.end(), samples.begin(), samples.begin() + kept);
+            carried_silence += samples.size() - kept;
+            return;
+        }
+        // The producer owns the slot after the queued ones until count says otherwise
+        Slot& slot = slots[(head + count) % QUEUE_FRAMES];
+        lock.unlock();
+
+        std::memcpy(slot.frame.data(), frame, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t));
+        slot.has_frame = true;
+        fillSlot(slot, samples);
+
+        lock.lock();
+        count++;
+        work_ready.notify_one();
+    }
+
+    // Writes out everything queued and closes the files
+    void close() {
+        if (writer.joinable()) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (carried_drops > 0) {
+                    // Frames dropped at the very end still get their place and audio
+                    space_ready.wait(lock, [this] { return count < QUEUE_FRAMES; });
+                    Slot& slot = slots[(head + count) % QUEUE_FRAMES];
+                    slot.has_frame = false;
+                    fillSlot(slot, {});
+                    count++;
+                }
+                stopping = true;
+            }
+            work_ready.notify_one();
+            writer.join();
+        }
+        if (video) {
+            std::fclose(video);
+            video = nullptr;
+        }
+        if (audio) {
+            if (wav && std::fseek(audio, 0, SEEK_SET) == 0) {
+                writeWAVHeader((uint32_t)(samples_written * 2));
+            }
+            std::fclose(audio);
+            audio = nullptr;
+        }
+    }
+
+    uint64_t framesWritten() const { return frames_written; }
+    uint64_t framesDropped() const { return frames_dropped; }
+
+private:
+    struct Slot {
+        std::vector<uint32_t> frame;
+        bool has_frame;     // False for the drops at the end, flushed by close()
+        std::vector<float> audio;
+        uint64_t silence;   // Samples of dropped frames that did not fit, before `audio`
+        uint32_t repeats;   // Frames dropped before this one, shown as the previous picture
+    };
+
+    FILE* video;
+    FILE* audio;
+    bool y4m;
+    bool wav;
+    std::vector<Slot> slots;
+    int head;               // Oldest queued slot
+    int count;              // Slots queued
+    bool stopping;
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable space_ready;
+    std::thread writer;
+    std::vector<uint8_t> frame_bytes;   // Writer's converted frame, repeated for drops
+    uint64_t frames_written;
+    uint64_t frames_dropped;
+    uint64_t samples_written;
+    std::vector<float> carried_audio;   // Audio of dropped frames, producer only
+    uint32_t carried_drops;
+    uint64_t carried_silence;
+    bool blocking;
+    std::vector<int16_t> pcm;
+
+    // Hand the drops since the last slot over to this one
+    void fillSlot(Slot& slot, const std::vector<float>& samples) {
+        slot.audio.assign(carried_audio.begin(), carried_audio.end());
+        slot.audio.insert(slot.audio.end(), samples.begin(), samples.end());
+        slot.silence = carried_silence;
+        slot.repeats = carried_drops;
+        carried_audio.clear();
+        carried_silence = 0;
+        carried_drops = 0;
+    }
+
+    static bool endsWith(const std::string& s, const char* suffix) {
+        size_t n = std::strlen(suffix);
+        return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+    }
+
+    void writeWAVHeader(uint32_t data_bytes) {
+        auto u32 = [this](uint32_t v) { uint8_t b[4] = {(uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24)}; std::fwrite(b, 1, 4, audio); };
+        auto u16 = [this](uint16_t v) { uint8_t b[2] = {(uint8_t)v, (uint8_t)(v >> 8)}; std::fwrite(b, 1, 2, audio); };
+        std::fwrite("RIFF", 1, 4, audio);
+        u32(data_bytes == 0xFFFFFFFF ? data_bytes : data_bytes + 36);
+        std::fwrite("WAVEfmt ", 1, 8, audio);
+        u32(16);
+        u16(1);                 // PCM
+        u16(1);                 // Mono
+        u32(SAMPLE_RATE);
+        u32(SAMPLE_RATE * 2);   // Bytes per second
+        u16(2);                 // Bytes per frame
+        u16(16);
+        std::fwrite("data", 1, 4, audio);
+        u32(data_bytes);
+    }
+
+    void writerLoop() {
+        while (true) {
+            Slot* slot;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_ready.wait(lock, [this] { return stopping || count > 0; });
+                if (count == 0) return;  // Stopping with nothing left
+                slot = &slots[head];
+            }
+
+            if (video) {
+                for (uint32_t i = 0; i < slot->repeats && !frame_bytes.empty(); i++) {
+                    writeFrame();
+                }
+                if (slot->has_frame) {
+                    convertFrame(slot->frame.data());
+                    writeFrame();
+                }
+            }
+            if (audio) {
+                writeSilence(slot->silence);
+                writeAudio(slot->audio);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            head = (head + 1) % QUEUE_FRAMES;
+            count--;
+            space_ready.notify_one();
+        }
+    }
+
+    void convertFrame(const uint32_t* frame) {
+        const int pixels = SCREEN_WIDTH * SCREEN_HEIGHT;
+        if (!y4m) {
+            frame_bytes.resize(pixels * 3);
+            for (int i = 0; i < pixels; i++) {
+                frame_bytes[i * 3] = frame[i] >> 16;
+                frame_bytes[i * 3 + 1] = frame[i] >> 8;
+                frame_bytes[i * 3 + 2] = frame[i];
+            }
+            return;
+        }
+        // BT.601 limited range, one plane each
+        frame_bytes.resize(pixels * 3);
+        uint8_t* y_plane = frame_bytes.data();
+        uint8_t* u_plane = y_plane + pixels;
+        uint8_t* v_plane = u_plane + pixels;
+        for (int i = 0; i < pixels; i++) {
+            int r = (frame[i] >> 16) & 0xFF, g = (frame[i] >> 8) & 0xFF, b = frame[i] & 0xFF;
+            y_plane[i] = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+            u_plane[i] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            v_plane[i] = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+    }
+
+    void writeFrame() {
+        if (y4m) {
+            std::fwrite("FRAME\n", 1, 6, video);
+        }
+        std::fwrite(frame_bytes.data(), 1, frame_bytes.size(), video);
+        frames_written++;
+    }
+
+    void writeSilence(uint64_t samples) {
+        std::vector<float> zeros(std::min<uint64_t>(samples, 4096), 0.0f);
+        while (samples > 0) {
+            zeros.resize(std::min<uint64_t>(samples, zeros.size()));
+            writeAudio(zeros);
+            samples -= zeros.size();
+        }
+    }
+
+    void writeAudio(const std::vector<float>& samples) {
+        if (!wav) {
+            std::fwrite(samples.data(), sizeof(float), samples.size(), audio);
+        } else {
+            pcm.resize(samples.size());
+            for (size_t i = 0; i < samples.size(); i++) {
+                pcm[i] = (int16_t)std::lround(std::max(-1.0f, std::min(1.0f, samples[i])) * 32767.0f);
+            }
+            std::fwrite(pcm.data(), sizeof(int16_t), pcm.size(), audio);
+        }
+        samples_written += samples.size();
+    }
+};
+
+// Shared-memory frontend for an orchestrator in another process. The
+// emulator creates a POSIX shared-memory segment and publishes every frame
+// into it: the screen, the frame's audio and the bytes of chosen RAM
+// regions, laid out as SharedFrontend::Header describes. Nothing is
+// serialized; the other process maps the same segment and reads in place.
+//
+// Frames are published under a seqlock. `sequence` is odd while a frame is
+// being written and 2 * frames run otherwise, so a reader copies what it
+// needs between two loads of `sequence` and retries if they differ or are
+// odd. Audio goes into its own ring: sample n sits at n % audio_capacity and
+// audio_written is the total written, so a reader more than a ring behind
+// knows it lost samples. The other process writes `input` (button bits as in
+// gb_vec_step: A, B, Select, Start, Right, Left, Up, Down from bit 0), raises
+// frames_requested to let the emulator run (UINT64_MAX runs freely) and sets
+// `quit` to stop it.
+class SharedFrontend {
+public:
+    static constexpr uint32_t MAGIC = 0x4D534247;      // "GBSM"
+    static constexpr uint32_t VERSION = 1;
+    static constexpr int MAX_REGIONS = 16;
+    static constexpr uint32_t AUDIO_CAPACITY = 16384;  // Samples, a power of two (~0.37 s)
+
+    struct Region {
+        uint16_t address;
+        uint16_t length;   // 0 only in unused entries
+        uint32_t offset;   // From the start of the segment
+    };
+
+    struct Header {
+        std::atomic<uint32_t> magic;   // Stored last, once the rest is set up
+        uint32_t version;
+        uint32_t total_bytes;
+        uint32_t screen_offset;    // width * height ARGB pixels (uint32_t)
+        uint32_t screen_width;
+        uint32_t screen_height;
+        uint32_t audio_offset;     // audio_capacity floats
+        uint32_t audio_capacity;
+        uint32_t sample_rate;
+        uint32_t region_count;
+        Region regions[MAX_REGIONS];
+
+        // Written by the emulator
+        alignas(64) std::atomic<uint64_t> sequence;
+        uint64_t cycles;           // Emulated cycles at the end of the frame
+        uint64_t screen_hash;      // Changes exactly when the screen does
+        std::atomic<uint64_t> audio_written;
+        std::atomic<uint32_t> running;   // Cleared when the emulator stops
+
+        // Written by the other process
+        alignas(64) std::atomic<uint32_t> input;
+        std::atomic<uint32_t> quit;
+        std::atomic<uint64_t> frames_requested;
+    };
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared atomics must not need a lock");
+
+    SharedFrontend() : header(nullptr), segment(nullptr), segment_bytes(0) {}
+
+    ~SharedFrontend() {
+        close();
+    }
+
+    // Parses "C000:2000,FF80:7F" (hex address:length pairs)
+    static bool parseRegions(const std::string& list, std::vector<Region>& regions) {
+        size_t start = 0;
+        while (start < list.size()) {
+            size_t end = list.find(',', start);
+            if (end == std::string::npos) {
+                end = list.size();
+            }
+            std::string item = list.substr(start, end - start);
+            size_t colon = item.find(':');
+            if (colon == std::string::npos) {
+                return false;
+            }
+            char* rest = nullptr;
+            unsigned long address = std::strtoul(item.c_str(), &rest, 16);
+            if (rest != item.c_str() + colon) {
+                return false;
+            }
+            unsigned long length = std::strtoul(item.c_str() + colon + 1, &rest, 16);
+            // Region::length is 16 bits, so a single region stops short of the whole map
+            if (*rest != '\0' || length == 0 || length > 0xFFFF || address + length > 0x10000 ||
+                regions.size() >= (size_t)MAX_REGIONS) {
+                return false;
+            }
+            regions.push_back({(uint16_t)address, (uint16_t)length, 0});
+            start = end + 1;
+        }
+        return true;
+    }
+
+    // Creates the segment `name` and lays it out. A name already in use is
+    // refused rather than taken over, it may belong to a running emulator.
+    bool open(const std::string& name, const std::vector<Region>& regions) {
+#if defined(_WIN32)
+        (void)name;
+        (void)regions;
+        std::cout << "The shared-memory frontend needs POSIX shm_open and is not supported on Windows" << std::endl;
+        return false;
+#else
+        shm_name = name[0] == '/' ? name : "/" + name;
+
+        uint32_t offset = align((uint32_t)sizeof(Header));
+        uint32_t screen_offset = offset;
+        offset = align(offset + SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t));
+        uint32_t audio_offset = offset;
+        offset = align(offset + AUDIO_CAPACITY * sizeof(float));
+        std::vector<Region> placed = regions;
+        for (Region& region : placed) {
+            region.offset = offset;
+            offset += region.length;
+        }
+        segment_bytes = align(offset);
+
+        int fd = shm_open(shm_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0 && errno == EEXIST) {
+            std::cout << "Shared memory " << shm_name << " already exists. Another emulator may be using it;"
+                      << " pick another name, or if it is stale remove it (on Linux, /dev/shm" << shm_name << ")" << std::endl;
+            return false;
+        }
+        if (fd < 0) {
+            std::cout << "Could not create shared memory " << shm_name << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        if (ftruncate(fd, segment_bytes) != 0) {
+            std::cout << "Could not size shared memory " << shm_name << ": " << std::strerror(errno) << std::endl;
+            ::close(fd);
+            shm_unlink(shm_name.c_str());
+            return false;
+        }
+        void* mapping = mmap(nullptr, segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            std::cout << "Could not map shared memory " << shm_name << ": " << std::strerror(errno) << std::endl;
+            shm_unlink(shm_name.c_str());
+            return false;
+        }
+        segment = (uint8_t*)mapping;
+        std::memset(segment, 0, segment_bytes);
+
+        header = new (segment) Header();
+        header->version = VERSION;
+        header->total_bytes = segment_bytes;
+        header->screen_offset = screen_offset;
+        header->screen_width = SCREEN_WIDTH;
+        header->screen_height = SCREEN_HEIGHT;
+        header->audio_offset = audio_offset;
+        header->audio_capacity = AUDIO_CAPACITY;
+        header->sample_rate = 44100;
+        header->region_count = (uint32_t)placed.size();
+        std::copy(placed.begin(), placed.end(), header->regions);
+        header->running.store(1, std::memory_order_relaxed);
+        header->magic.store(MAGIC, std::memory_order_release);
+
+        region_bytes.resize(offset - (placed.empty() ? 0 : placed[0].offset));
+        return true;
+#endif
+    }
+
+    // Marks the emulator as stopped and removes the segment; readers that
+    // still have it mapped keep the last frame
+    void close() {
+#if !defined(_WIN32)
+        if (segment) {
+            header->running.store(0, std::memory_order_release);
+            munmap(segment, segment_bytes);
+            shm_unlink(shm_name.c_str());
+            segment = nullptr;
+            header = nullptr;
+        }
+#endif
+    }
+
+    uint8_t input() const { return (uint8_t)header->input.load(std::memory_order_acquire); }
+    bool quitRequested() const { return header->quit.load(std::memory_order_acquire) != 0; }
+    uint64_t framesRequested() const { return header->frames_requested.load(std::memory_order_acquire); }
+    uint64_t framesPublished() const { return header->sequence.load(std::memory_order_relaxed) / 2; }
+    const std::string& name() const { return shm_name; }
+
+    template<class GB>
+    void publish(GB& gameboy, const std::vector<float>& samples) {
+        // Audio first, so a reader that sees a frame also has its samples
+        float* ring = (float*)(segment + header->audio_offset);
+        uint64_t written = header->audio_written.load(std::memory_order_relaxed);
+        for (float sample : samples) {
+            ring[written++ & (AUDIO_CAPACITY - 1)] = sample;
+        }
+        header->audio_written.store(written, std::memory_order_release);
+
+        // RAM is read through the bus before the frame is opened, keeping
+        // the odd window down to a few copies
+        uint8_t* staged = region_bytes.data();
+        for (uint32_t r = 0; r < header->region_count; r++) {
+            const Region& region = header->regions[r];
+            for (uint32_t i = 0; i < region.length; i++) {
+                *staged++ = gameboy.readMemory((uint16_t)(region.address + i));
+            }
+        }
+
+        uint64_t sequence = header->sequence.load(std::memory_order_relaxed);
+        header->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(segment + header->screen_offset, gameboy.getScreen().data(),
+                    SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32_t));
+        if (!region_bytes.empty()) {
+            std::memcpy(segment + header->regions[0].offset, region_bytes.data(), region_bytes.size());
+        }
+        header->cycles = gameboy.getTotalCycles();
+        header->screen_hash = gameboy.getScreenHash();
+        header->sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+private:
+    Header* header;
+    uint8_t* segment;
+    uint32_t segment_bytes;
+    std::string shm_name;
+    std::vector<uint8_t> region_bytes;   // Staging for the RAM regions, which are contiguous
+
+    static uint32_t align(uint32_t offset) {
+        return (offset + 63) & ~63u;
+    }
+};
+
+#ifndef GB_HEADLESS
+
+// SDL Display
+class Display {
+private:
+    SDL_Window* window;
+    SDL_Renderer* renderer;
+    SDL_Texture* texture;
+    uint64_t shown_hash;   // Hash of the pixels currently in the texture
+    bool texture_valid;
+    std::unique_ptr<Upscaler> upscaler;  // Null for SDL's own nearest scaling
+    bool scaling;          // A frame is with the upscaler, not uploaded yet
+    bool pipelined;        // Scale behind emulation, one frame late
+    
+public:
+    Display(Upscaler::Filter filter = Upscaler::NONE, int filter_threads = 0) {
+        shown_hash = 0;
+        texture_valid = false;
+        scaling = false;
+        pipelined = true;
+        if (filter != Upscaler::NONE) {
+            upscaler.reset(new Upscaler(filter, filter_threads));
+        }
+        int texture_scale = Upscaler::factor(filter);
+        
+        window = SDL_CreateWindow(
+            "Game Boy Emulator",
+            SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+            SCREEN_WIDTH * SCALE, SCREEN_HEIGHT * SCALE,
+            SDL_WINDOW_SHOWN
+        );
+        
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+        
+        texture = SDL_CreateTexture(
+            renderer,
+            SDL_PIXELFORMAT_ARGB8888,
+            SDL_TEXTUREACCESS_STREAMING,
+            SCREEN_WIDTH * texture_scale, SCREEN_HEIGHT * texture_scale
+        );
+    }
+    
+    ~Display() {
+        if (upscaler) {
+            upscaler->wait();
+            std::cout << "Upscaling: " << upscaler->averageMilliseconds() << " ms/frame on "
+                      << upscaler->threadCount() << " threads" << std::endl;
+        }
+        SDL_DestroyTexture(texture);
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+    }
+    
+    // Off: scale each frame and wait for it before showing it. A frame of
+    // scaling costs well under a millisecond, less than the latency run-ahead
+    // is there to remove.
+    void setPipelined(bool enabled) {
+        pipelined = enabled;
+    }
+
+    // `hash` identifies the frame contents; an unchanged frame skips the upload.
+    // With an upscaler the frame is scaled while the next one is emulated
+    // and shown one frame later, unless pipelining is off.
+    void render(const std::array<uint32_t, SCREEN_WIDTH * SCREEN_HEIGHT>& pixels, uint64_t hash) {
+        if (upscaler) {
+            if (scaling) {
+                SDL_UpdateTexture(texture, nullptr, upscaler->wait(), upscaler->width() * sizeof(uint32_t));
+                scaling = false;
+                texture_valid = true;
+            }
+            if (!texture_valid || hash != shown_hash) {
+                upscaler->submit(pixels.data());
+                shown_hash = hash;
+                scaling = true;
+            }
+            if (scaling && !pipelined) {
+                SDL_UpdateTexture(texture, nullptr, upscaler->wait(), upscaler->width() * sizeof(uint32_t));
+                scaling = false;
+                texture_valid = true;
+            }
+        } else if (!texture_valid || hash != shown_hash) {
+            SDL_UpdateTexture(texture, nullptr, pixels.data(), SCREEN_WIDTH * sizeof(uint32_t));
+            shown_hash = hash;
+            texture_valid = true;
+        }
+        SDL_RenderClear(renderer);
+        if (texture_valid) {
+            SDL_RenderCopy(renderer, texture, nullptr, nullptr);
+        }
+        SDL_RenderPresent(renderer);
+    }
+};
+
+#endif // GB_HEADLESS
+
+// Headless replay of a movie as fast as possible, checking every frame hash
+int replayMovie(const std::string& rom_file, const std::string& movie_file, GuestProfiler* profiler = nullptr,
+                CaptureSink* capture = nullptr) {
+    Movie movie;
+    if (!movie.load(movie_file)) {
+        return 1;
+    }
+
+    GameBoy gameboy;
+    if (!gameboy.loadROM(rom_file)) {
+        return 1;
+    }
+    if (gameboy.romHash() != movie.rom_hash) {
+        std::cout << "Movie was recorded with a different ROM" << std::endl;
+        return 1;
+    }
+    gameboy.setGuestProfiler(profiler);
+    gameboy.setFifoRenderer(movie.fifo_renderer);  // Hashes are only comparable with the same renderer
+    if (capture) {
+        capture->setBlocking(true);  // No deadline to keep, so keep every frame
+    }
+
+    std::vector<float> audio;
+    auto start = std::chrono::steady_clock::now();
+    size_t next_event = 0;
+    for (uint32_t frame = 0; frame < movie.frame_hashes.size(); frame++) {
+        while (next_event < movie.events.size() && movie.events[next_event].frame == frame) {
+            const Movie::InputEvent& event = movie.events[next_event++];
+            if (event.cycle != gameboy.getTotalCycles()) {
+                std::cout << "Desync at frame " << frame << ": input expected at cycle " << event.cycle
+                          << ", emulator is at " << gameboy.getTotalCycles() << std::endl;
+                return 1;
+            }
+            gameboy.setButtonState(event.button, event.pressed);
+        }
+
+        if (capture) {
+            audio.clear();
+            gameboy.runFrame(&audio);
+            capture->push(gameboy.getScreen().data(), audio);
+        } else {
+            gameboy.runFrame(nullptr);
+        }
+
+        uint32_t hash = Movie::foldHash(gameboy.getScreenHash());
+        if (hash != movie.frame_hashes[frame]) {
+            std::cout << "Desync at frame " << frame << ": frame hash " << std::hex << hash
+                      << ", recorded " << movie.frame_hashes[frame] << std::dec << std::endl;
+            return 1;
+        }
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    elapsed = std::max<long long>(1, elapsed);
+    std::cout << "Replay OK: " << movie.frame_hashes.size() << " frames, " << movie.events.size()
+              << " inputs in " << elapsed << " ms ("
+              << (movie.frame_hashes.size() * 1000 / elapsed) << " fps)" << std::endl;
+    return 0;
+}
+
+static volatile std::sig_atomic_t shared_frontend_interrupted = 0;
+
+static void interruptSharedFrontend(int) {
+    shared_frontend_interrupted = 1;
+}
+
+// Headless run driven through a SharedFrontend segment: frames run while the
+// other process has requested more, with the inputs it wrote, until it sets
+// quit or the emulator is interrupted
+int runSharedFrontend(const std::string& rom_file, const std::string& name,
+                      const std::vector<SharedFrontend::Region>& regions, bool fifo_renderer) {
+    GameBoy gameboy;
+    if (!gameboy.loadROM(rom_file)) {
+        return 1;
+    }
+    gameboy.setFifoRenderer(fifo_renderer);
+
+    SharedFrontend frontend;
+    if (!frontend.open(name, regions)) {
+        return 1;
+    }
+    // Ctrl-C still removes the segment
+    std::signal(SIGINT, interruptSharedFrontend);
+    std::signal(SIGTERM, interruptSharedFrontend);
+    std::cout << "Shared memory " << frontend.name() << " ready, waiting for frame requests" << std::endl;
+
+    int exit_code = 0;
+    std::vector<float> audio;
+    int idle_polls = 0;
+    while (!frontend.quitRequested() && !shared_frontend_interrupted) {
+        if (frontend.framesPublished() >= frontend.framesRequested()) {
+            // Spin briefly for lockstep callers, then stop burning a core
+            if (++idle_polls < 1000) {
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            continue;
+        }
+        idle_polls = 0;
+
+        uint8_t input = frontend.input();
+        for (int button = 0; button < 8; button++) {
+            gameboy.setButtonState(button, (input >> button) & 1);
+        }
+        audio.clear();
+        gameboy.runFrame(&audio);
+        frontend.publish(gameboy, audio);
+
+        if (gameboy.isCPULocked()) {
+            std::cout << "CPU locked up on opcode 0x" << std::hex << (int)gameboy.readMemory(gameboy.getPC())
+                      << " at PC 0x" << gameboy.getPC() << std::dec << ", stopping" << std::endl;
+            exit_code = 1;
+            break;
+        }
+    }
+    std::cout << "Shared memory: " << frontend.framesPublished() << " frames published" << std::endl;
+    frontend.close();
+    return exit_code;
+}
+
+// Steps/second of VecEnv for 1, 2, 4 ... max_envs copies of a ROM
+int runVecBenchmark(const std::string& rom_file, int max_envs) {
+    ROMImage rom = Memory::readROMFile(rom_file);
+    if (!rom) {
+        return 1;
+    }
+
+    std::cout << "envs  threads  steps/s  frames/s per env" << std::endl;
+    for (int n = 1; n <= max_envs; n *= 2) {
+        VecEnv env(rom, n, 0, {0xC000}, 1);
+        std::vector<uint32_t> observations((size_t)n * VecEnv::OBSERVATION_PIXELS);
+        std::vector<uint8_t> actions(n);
+        std::vector<uint8_t> rewards(n);
+        env.reset(observations.data());
+
+        // Random but repeatable button mashing
+        uint32_t seed = 12345;
+        int steps = 0;
+        auto start = std::chrono::steady_clock::now();
+        double elapsed = 0.0;
+        while (elapsed < 1.0 || steps < 10) {
+            for (uint8_t& action : actions) {
+                seed = seed * 1664525u + 1013904223u;
+                action = seed >> 24;
+            }
+            env.step(actions.data(), observations.data(), rewards.data());
+            steps++;
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        double steps_per_sec = steps * n / elapsed;
+        std::cout << n << "  " << env.threadCount() << "  " << (long long)steps_per_sec << "  " << (long long)(steps / elapsed) << std::endl;
+    }
+    return 0;
+}
+
+// ms/frame of every upscaling filter on 1, 2, 4 ... threads, scaling a
+// frame from a few seconds into the ROM
+int runScalerBenchmark(const std::string& rom_file, int max_threads) {
+    GameBoy gameboy;
+    if (!gameboy.loadROM(rom_file)) {
+        return 1;
+    }
+    for (int frame = 0; frame < 600; frame++) {
+        gameboy.setButtonState(Memory::BTN_START, frame % 120 >= 100);
+        gameboy.runFrame(nullptr);
+    }
+
+    const Upscaler::Filter filters[] = {Upscaler::SCALE2X, Upscaler::SCALE3X, Upscaler::HQ2X,
+                                        Upscaler::XBR, Upscaler::LCD_GRID};
+    const char* names[] = {"scale2x", "scale3x", "hq2x", "xbr", "lcd"};
+    std::cout << "filter  output  threads  ms/frame" << std::endl;
+    for (size_t f = 0; f < std::size(filters); f++) {
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            Upscaler upscaler(filters[f], threads);
+            for (int i = 0; i < 300; i++) {
+                upscaler.submit(gameboy.getScreen().data());
+                upscaler.wait();
+            }
+            std::cout << names[f] << "  " << upscaler.width() << "x" << upscaler.height() << "  "
+                      << threads << "  " << upscaler.averageMilliseconds() << std::endl;
+        }
+    }
+    return 0;
+}
+
+// Binary trace dump (or any trace) to a gameboy-doctor text log
+int convertTrace(const std::string& in_file, const std::string& out_file) {
+    TraceReader reader;
+    if (!reader.open(in_file)) {
+        return 1;
+    }
+    std::ofstream out(out_file);
+    if (!out) {
+        std::cout << "Could not write " << out_file << std::endl;
+        return 1;
+    }
+    std::string line;
+    size_t count = 0;
+    while (reader.next(line)) {
+        out << line << '\n';
+        count++;
+    }
+    std::cout << "Converted " << count << " lines to " << out_file << std::endl;
+    return 0;
+}
+
+// Streams two traces (binary dumps or doctor logs, in any mix) and reports
+// the first line where they differ, with the lines leading up to it
+int diffTraces(const std::string& file_a, const std::string& file_b) {
+    TraceReader a, b;
+    if (!a.open(file_a) || !b.open(file_b)) {
+        return 1;
+    }
+    const size_t CONTEXT = 5;
+    std::deque<std::string> context;
+    std::string line_a, line_b;
+    for (uint64_t index = 0;; index++) {
+        bool more_a = a.next(line_a);
+        bool more_b = b.next(line_b);
+        if (!more_a && !more_b) {
+            std::cout << "Traces match (" << index << " lines)" << std::endl;
+            return 0;
+        }
+        if (more_a != more_b || line_a != line_b) {
+            std::cout << "First divergence at line " << index + 1 << ":" << std::endl;
+            for (const std::string& previous : context) {
+                std::cout << "    " << previous << std::endl;
+            }
+            std::cout << "  < " << (more_a ? line_a : "(end of trace)") << std::endl;
+            std::cout << "  > " << (more_b ? line_b : "(end of trace)") << std::endl;
+            return 1;
+        }
+        context.push_back(line_a);
+        if (context.size() > CONTEXT) {
+            context.pop_front();
+        }
+    }
+}
+
+// Runs test ROMs headless until their serial output passes or fails, the CPU
+// locks up on an illegal opcode, or timeout_cycles pass. Jobs run in parallel.
+// With trace_entries > 0 the last instructions of every ROM that does not
+// pass are written to <ROM file>.gbtr. Machine picks the timing model.
+template<class Machine>
+int runTestROMs(const std::vector<std::string>& rom_files, uint64_t timeout_cycles, int jobs, size_t trace_entries,
+                bool fifo_renderer) {
+    struct TestRun {
+        ROMImage rom;
+        const char* result;
+        uint64_t cycles;
+        long long wall_ms;
+        std::string output;
+        std::string crash;
+    };
+    std::vector<TestRun> runs(rom_files.size());
+    for (size_t i = 0; i < rom_files.size(); i++) {
+        runs[i].rom = Memory::readROMFile(rom_files[i]);
+        runs[i].result = runs[i].rom ? "TIMEOUT" : "NO ROM";
+        runs[i].cycles = 0;
+        runs[i].wall_ms = 0;
+    }
+
+    std::atomic<size_t> next_run(0);
+    auto worker = [&]() {
+        for (size_t i = next_run++; i < runs.size(); i = next_run++) {
+            TestRun& run = runs[i];
+            if (!run.rom) {
+                continue;
+            }
+            auto start = std::chrono::steady_clock::now();
+            Machine gameboy;
+            SerialTestMatcher matcher;
+            std::unique_ptr<TraceRing> trace;
+            gameboy.loadROM(run.rom);
+            gameboy.setSerialSink(&matcher);
+            gameboy.setFifoRenderer(fifo_renderer);
+            if (trace_entries > 0) {
+                trace.reset(new TraceRing(trace_entries));
+                gameboy.setTrace(trace.get());
+            }
+            while (gameboy.getTotalCycles() < timeout_cycles) {
+                gameboy.runFrame(nullptr);
+                if (matcher.getResult() != SerialTestMatcher::RUNNING) {
+                    run.result = matcher.getResult() == SerialTestMatcher::PASSED ? "PASSED" : "FAILED";
+                    break;
+                }
+                if (gameboy.isCPULocked()) {
+                    run.result = "CRASHED";
+                    char where[48];
+                    std::snprintf(where, sizeof(where), "illegal opcode %02X at PC %04X",
+                                  gameboy.readMemory(gameboy.getPC()), gameboy.getPC());
+                    run.crash = where;
+                    break;
+                }
+            }
+            run.cycles = gameboy.getTotalCycles();
+            run.wall_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            run.output = matcher.printableTail();
+            if (trace && std::strcmp(run.result, "PASSED") != 0) {
+                trace->dump(rom_files[i] + ".gbtr");
+            }
+        }
+    };
+
+    jobs = std::max(1, std::min<int>(jobs, (int)runs.size()));
+    std::vector<std::thread> threads;
+    for (int t = 1; t < jobs; t++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    int passed = 0;
+    for (size_t i = 0; i < runs.size(); i++) {
+        const TestRun& run = runs[i];
+        std::cout << run.result << "  " << rom_files[i] << "  "
+                  << (double)run.cycles / CPU_FREQUENCY << " s emulated, " << run.wall_ms << " ms";
+        if (!run.crash.empty()) {
+            std::cout << "  " << run.crash;
+        }
+        if (!run.output.empty()) {
+            std::cout << "  \"" << run.output << "\"";
+        }
+        std::cout << std::endl;
+        if (std::strcmp(run.result, "PASSED") == 0) {
+            passed++;
+        }
+    }
+    std::cout << passed << "/" << runs.size() << " passed" << std::endl;
+    return passed == (int)runs.size() ? 0 : 1;
+}
+
+// Standalone differential fuzzing: `streams` random instruction streams on
+// `jobs` threads. Prints the first mismatch seen for each opcode.
+int runCPUFuzzer(uint64_t streams, int jobs) {
+    std::atomic<uint64_t> next_stream(0);
+    std::atomic<uint64_t> instructions(0);
+    std::mutex mismatch_mutex;
+    std::map<int, std::string> mismatches;  // Opcode (0x1xx = CB) -> first report
+
+    auto worker = [&](uint32_t seed) {
+        CPUFuzzer fuzzer;
+        uint8_t data[13 + CPUFuzzer::MAX_STEPS * 3];
+        uint64_t executed = 0;
+        const uint64_t BATCH = 4096;
+        for (uint64_t first = next_stream.fetch_add(BATCH); first < streams; first = next_stream.fetch_add(BATCH)) {
+            for (uint64_t n = first; n < std::min(first + BATCH, streams); n++) {
+                for (uint8_t& byte : data) {
+                    seed ^= seed << 13;
+                    seed ^= seed >> 17;
+                    seed ^= seed << 5;
+                    byte = (uint8_t)seed;
+                }
+                std::string report;
+                int key = 0;
+                int steps = fuzzer.run(data, sizeof(data), &report, &key);
+                if (steps < 0) {
+                    std::lock_guard<std::mutex> lock(mismatch_mutex);
+                    mismatches.emplace(key, report);
+                } else {
+                    executed += steps;
+                }
+            }
+        }
+        instructions += executed;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    jobs = std::max(1, jobs);
+    std::vector<std::thread> threads;
+    for (int t = 1; t < jobs; t++) {
+        threads.emplace_back(worker, 0x9E3779B9u * (t + 1));
+    }
+    worker(0x9E3779B9u);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::max(1e-9, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+    for (const auto& entry : mismatches) {
+        char name[16];
+        std::snprintf(name, sizeof(name), entry.first & 0x100 ? "CB %02X" : "%02X", entry.first & 0xFF);
+        std::cout << "Mismatch on opcode " << name << ":\n" << entry.second << std::endl;
+    }
+    std::cout << streams << " streams, " << instructions.load() << " instructions in " << seconds << " s ("
+              << (long long)(instructions.load() / seconds) << " instructions/s), "
+              << mismatches.size() << " opcodes mismatched" << std::endl;
+    return mismatches.empty() ? 0 : 1;
+}
+
+#ifdef GB_FUZZ
+// libFuzzer entry point: clang++ -g -O1 -fsanitize=fuzzer,address -DGB_FUZZ gameboy.cpp
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    static CPUFuzzer fuzzer;
+    std::string report;
+    if (fuzzer.run(data, std::min<size_t>(size, 13 + CPUFuzzer::MAX_STEPS * 3), &report, nullptr) < 0) {
+        std::cerr << report;
+        std::abort();
+    }
+    return 0;
+}
+#endif
+
+// Just enough JSON for test vector files: numbers are kept as doubles,
+// objects as key/value lists in file order
+struct JsonValue {
+    enum Type { NUL, BOOL, NUMBER, STRING, ARRAY, OBJECT };
+    Type type = NUL;
+    double number = 0;
+    std::string string;
+    std::vector<JsonValue> items;                            // ARRAY
+    std::vector<std::pair<std::string, JsonValue>> members;  // OBJECT
+
+    const JsonValue* get(const char* key) const {
+        for (const auto& member : members) {
+            if (member.first == key) {
+                return &member.second;
+            }
+        }
+        return nullptr;
+    }
+
+    int intOr(const char* key, int fallback) const {
+        const JsonValue* value = get(key);
+        return value && value->type == NUMBER ? (int)value->number : fallback;
+    }
+};
+
+class JsonParser {
+private:
+    const char* p;
+    const char* end;
+
+    void skipSpace() {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) {
+            p++;
+        }
+    }
+
+    bool parseString(std::string& out) {
+        p++;  // Opening quote
+        while (p < end && *p != '"') {
+            if (*p == '\\' && p + 1 < end) {
+                p++;
+                switch (*p) {
+                    case 'n': out += '\n'; break;
+                    case 't': out += '\t'; break;
+                    case 'u': out += '?'; p += 4; break;  // Not needed for test names
+                    default: out += *p; break;
+                }
+                p++;
+            } else {
+                out += *p++;
+            }
+        }
+        if (p >= end) {
+            return false;
+        }
+        p++;
+        return true;
+    }
+
+public:
+    bool parse(const char* text, size_t length, JsonValue& out) {
+        p = text;
+        end = text + length;
+        return parseValue(out);
+    }
+
+    bool parseValue(JsonValue& out) {
+        skipSpace();
+        if (p >= end) {
+            return false;
+        }
+        if (*p == '{') {
+            out.type = JsonValue::OBJECT;
+            p++;
+            skipSpace();
+            if (p < end && *p == '}') {
+                p++;
+                return true;
+            }
+            while (true) {
+                skipSpace();
+                if (p >= end || *p != '"') {
+                    return false;
+                }
+                out.members.emplace_back();
+                if (!parseString(out.members.back().first)) {
+                    return false;
+                }
+                skipSpace();
+                if (p >= end || *p++ != ':' || !parseValue(out.members.back().second)) {
+                    return false;
+                }
+                skipSpace();
+                if (p < end && *p == ',') {
+                    p++;
+                } else if (p < end && *p == '}') {
+                    p++;
+                    return true;
+                } else {
+                    return false;
+                }
+            }
+        }
+        if (*p == '[') {
+            out.type = JsonValue::ARRAY;
+            p++;
+            skipSpace();
+            if (p < end && *p == ']') {
+                p++;
+                return true;
+            }
+            while (true) {
+                out.items.emplace_back();
+                if (!parseValue(out.items.back())) {
+                    return false;
+                }
+                skipSpace();
+                if (p < end && *p == ',') {
+                    p++;
+                } else if (p < end && *p == ']') {
+                    p++;
+                    return true;
+                } else {
+                    return false;
+                }
+            }
+        }
+        if (*p == '"') {
+            out.type = JsonValue::STRING;
+            return parseString(out.string);
+        }
+        if (end - p >= 4 && std::strncmp(p, "true", 4) == 0) {
+            out.type = JsonValue::BOOL;
+            out.number = 1;
+            p += 4;
+            return true;
+        }
+        if (end - p >= 5 && std::strncmp(p, "false", 5) == 0) {
+            out.type = JsonValue::BOOL;
+            p += 5;
+            return true;
+        }
+        if (end - p >= 4 && std::strncmp(p, "null", 4) == 0) {
+            p += 4;
+            return true;
+        }
+        char* number_end;
+        out.number = std::strtod(p, &number_end);
+        if (number_end == p) {
+            return false;
+        }
+        out.type = JsonValue::NUMBER;
+        p = number_end;
+        return true;
+    }
+};
+
+// Runs per-opcode JSON test vectors (the SingleStepTests sm83 format: a
+// list of {name, initial, final, cycles} where states hold the registers,
+// ime, ie and "ram": [[addr, value], ...]) against BasicCPU on a FlatBus.
+// Every .json file in `dir` is one opcode; files run in parallel.
+int runSingleStepTests(const std::string& dir, int jobs) {
+    using TestCPU = BasicCPU<FlatBus>;
+
+    std::vector<std::string> files;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(dir, error)) {
+        if (entry.path().extension() == ".json") {
+            files.push_back(entry.path().string());
+        }
+    }
+    if (error || files.empty()) {
+        std::cout << "No .json test files in " << dir << std::endl;
+        return 1;
+    }
+    std::sort(files.begin(), files.end());
+
+    struct FileResult {
+        int tests = 0;
+        int failed = 0;
+        std::string first_failure;
+    };
+    std::vector<FileResult> results(files.size());
+
+    auto runFile = [](const std::string& file, FileResult& result) {
+        std::ifstream in(file, std::ios::binary);
+        std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        JsonValue tests;
+        JsonParser parser;
+        if (!parser.parse(text.data(), text.size(), tests) || tests.type != JsonValue::ARRAY) {
+            result.failed = 1;
+            result.first_failure = "could not parse";
+            return;
+        }
+
+        // Some generators store PC after the opcode fetch. The file decides
+        // once, from the first test whose bytes tell the two layouts apart
+        // (opcode at PC-1 but not at PC, or the other way round); the test
+        // name starts with the opcode. Deciding per test would flip on any
+        // test whose operand happens to equal the opcode.
+        bool prefetched = false;
+        for (const JsonValue& test : tests.items) {
+            const JsonValue* initial = test.get("initial");
+            const JsonValue* name = test.get("name");
+            const JsonValue* ram = initial ? initial->get("ram") : nullptr;
+            if (!name || !ram) {
+                continue;
+            }
+            int opcode = (int)std::strtol(name->string.c_str(), nullptr, 16);
+            uint16_t pc = (uint16_t)initial->intOr("pc", 0);
+            int at_pc = -1, before_pc = -1;
+            for (const JsonValue& cell : ram->items) {
+                if (cell.items.size() == 2 && (uint16_t)cell.items[0].number == pc) {
+                    at_pc = (int)cell.items[1].number;
+                } else if (cell.items.size() == 2 && (uint16_t)cell.items[0].number == (uint16_t)(pc - 1)) {
+                    before_pc = (int)cell.items[1].number;
+                }
+            }
+            if ((at_pc == opcode) != (before_pc == opcode)) {
+                prefetched = before_pc == opcode;
+                break;
+            }
+        }
+
+        FlatBus bus;
+        bus.fill(1);
+        TestCPU cpu(&bus);
+        for (const JsonValue& test : tests.items) {
+            const JsonValue* initial = test.get("initial");
+            const JsonValue* final_state = test.get("final");
+            const JsonValue* cycles = test.get("cycles");
+            const JsonValue* name = test.get("name");
+            if (!initial || !final_state) {
+                continue;
+            }
+            result.tests++;
+
+            TestCPU::State state;
+            state.regs.a = initial->intOr("a", 0);
+            state.regs.f = initial->intOr("f", 0);
+            state.regs.b = initial->intOr("b", 0);
+            state.regs.c = initial->intOr("c", 0);
+            state.regs.d = initial->intOr("d", 0);
+            state.regs.e = initial->intOr("e", 0);
+            state.regs.h = initial->intOr("h", 0);
+            state.regs.l = initial->intOr("l", 0);
+            state.regs.sp = initial->intOr("sp", 0);
+            state.regs.pc = initial->intOr("pc", 0);
+            state.ime = initial->intOr("ime", 0) != 0;
+            state.halted = false;
+            state.ei_pending = initial->intOr("ei", 0) != 0;
+            state.locked = false;
+            // IF would otherwise hold fill() noise, which the CPU ANDs with IE;
+            // a vector that lists 0xFF0F in its RAM still sets it below
+            bus.poke(0xFF0F, initial->intOr("if", 0));
+            if (const JsonValue* ram = initial->get("ram")) {
+                for (const JsonValue& cell : ram->items) {
+                    if (cell.items.size() == 2) {
+                        bus.poke((uint16_t)cell.items[0].number, (uint8_t)cell.items[1].number);
+                    }
+                }
+            }
+            bus.poke(0xFFFF, initial->intOr("ie", 0));
+
+            if (prefetched) {
+                state.regs.pc--;
+            }
+            cpu.loadState(state);
+            int taken = cpu.step();
+            // A prefetching core fetches the next opcode as part of this one
+            TestCPU::State after;
+            cpu.saveState(after);
+            if (prefetched) {
+                after.regs.pc++;
+            }
+
+            std::string mismatch;
+            auto check = [&](const char* what, int got, int expected) {
+                if (got != expected && mismatch.empty()) {
+                    char text[96];
+                    std::snprintf(text, sizeof(text), "%s is %X, expected %X", what, got, expected);
+                    mismatch = text;
+                }
+            };
+            check("A", after.regs.a, final_state->intOr("a", 0));
+            check("F", after.regs.f, final_state->intOr("f", 0));
+            check("B", after.regs.b, final_state->intOr("b", 0));
+            check("C", after.regs.c, final_state->intOr("c", 0));
+            check("D", after.regs.d, final_state->intOr("d", 0));
+            check("E", after.regs.e, final_state->intOr("e", 0));
+            check("H", after.regs.h, final_state->intOr("h", 0));
+            check("L", after.regs.l, final_state->intOr("l", 0));
+            check("SP", after.regs.sp, final_state->intOr("sp", 0));
+            check("PC", after.regs.pc, final_state->intOr("pc", 0));
+            if (final_state->get("ime")) {
+                check("IME", after.ime, final_state->intOr("ime", 0));
+            }
+            if (const JsonValue* ram = final_state->get("ram")) {
+                for (const JsonValue& cell : ram->items) {
+                    if (cell.items.size() == 2) {
+                        uint16_t addr = (uint16_t)cell.items[0].number;
+                        check(("RAM " + std::to_string(addr)).c_str(), bus.read(addr), (int)cell.items[1].number);
+                    }
+                }
+            }
+            if (cycles) {
+                check("cycles", taken, (int)cycles->items.size() * 4);
+            }
+
+            if (!mismatch.empty()) {
+                if (result.failed++ == 0) {
+                    result.first_failure = (name ? name->string : "?") + ": " + mismatch;
                 }
-                
-                framebuffer[scanline * SCREEN_WIDTH + x] = color;
             }
+            bus.rollback();
         }
+    };
+
+    std::atomic<size_t> next_file(0);
+    auto worker = [&]() {
+        for (size_t i = next_file++; i < files.size(); i = next_file++) {
+            runFile(files[i], results[i]);
+        }
+    };
+    auto start = std::chrono::steady_clock::now();
+    jobs = std::max(1, std::min<int>(jobs, (int)files.size()));
+    std::vector<std::thread> threads;
+    for (int t = 1; t < jobs; t++) {
+        threads.emplace_back(worker);
     }
-    
-    renderSprites();  
+    worker();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    int total = 0;
+    int failed_files = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        total += results[i].tests;
+        if (results[i].failed) {
+            failed_files++;
+            std::cout << "FAIL  " << std::filesystem::path(files[i]).filename().string() << "  "
+                      << results[i].failed << "/" << results[i].tests << "  " << results[i].first_failure << std::endl;
+        }
+    }
+    std::cout << files.size() - failed_files << "/" << files.size() << " opcode files passed, "
+              << total << " tests in " << seconds << " s" << std::endl;
+    return failed_files == 0 ? 0 : 1;
 }
 
-void renderSprites() {
-    uint8_t lcdc = memory->read(0xFF40);
-    
-    // Check if sprites are enabled (bit 1)
-    if (!(lcdc & 0x02)) {
-        return;
+// Peak resident set size of the whole process, in KB
+long long peakRSSKilobytes() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return (long long)(counters.PeakWorkingSetSize / 1024);
     }
-    
-    // Sprite height: 8x8 or 8x16 (bit 2)
-    int sprite_height = (lcdc & 0x04) ? 16 : 8;
-    
-    static bool printed_oam = false;
-    if (!printed_oam) {
-        std::cout << "\n=== OAM CONTENTS ===" << std::endl;
-        for (int i = 0; i < 5; i++) {  // Check first 5 sprites
-            uint16_t oam_addr = 0xFE00 + (i * 4);
-            uint8_t y = memory->read(oam_addr);
-            uint8_t x = memory->read(oam_addr + 1);
-            uint8_t tile = memory->read(oam_addr + 2);
-            uint8_t flags = memory->read(oam_addr + 3);
-            
-            std::cout << "Sprite " << i << ": "
-                     << "Y=" << std::dec << (int)y << " (screen: " << ((int)y - 16) << ") "
-                     << "X=" << (int)x << " (screen: " << ((int)x - 8) << ") "
-                     << "Tile=0x" << std::hex << (int)tile << std::dec
-                     << " Flags=0x" << std::hex << (int)flags << std::dec << std::endl;
+    return 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / 1024;  // Bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+// Fixed workload for tracking emulator speed across commits: each ROM runs
+// headless for `frames` frames with the same scripted input every time.
+// Results are printed and, if json_file is set, written there as JSON. Peak
+// RSS only ever grows within a process, so it is reported once for the run.
+struct BenchResult {
+    std::string rom;
+    const char* timing;
+    const char* renderer;
+    uint64_t instructions;
+    uint64_t cycles;
+    double seconds;
+    double bg_reuse;        // Share of background rows reused, scanline renderer only
+};
+
+// `text` as a JSON string literal, quotes included
+std::string jsonString(const std::string& text) {
+    std::string out = "\"";
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += (char)c;
+        } else if (c < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += (char)c;
         }
-        std::cout << "Sprite height: " << sprite_height << std::endl;
-        printed_oam = true;
     }
-    
-    // Read all sprites from OAM
-    std::array<Sprite, 40> sprites;
-    for (int i = 0; i < 40; i++) {
-        uint16_t oam_addr = 0xFE00 + (i * 4);
-        sprites[i].y = memory->read(oam_addr);
-        sprites[i].x = memory->read(oam_addr + 1);
-        sprites[i].tile = memory->read(oam_addr + 2);
-        sprites[i].flags = memory->read(oam_addr + 3);
+    return out + "\"";
+}
+
+template<class Machine>
+BenchResult benchmarkROM(const std::string& rom_file, const ROMImage& rom, int frames, const char* timing,
+                         bool fifo_renderer = false) {
+    Machine gameboy;
+    gameboy.loadROM(rom);
+    gameboy.setFifoRenderer(fifo_renderer);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++) {
+        // Tap Start to get past title screens, mash A in between
+        gameboy.setButtonState(Memory::BTN_START, frame % 120 >= 100);
+        gameboy.setButtonState(Memory::BTN_A, frame % 90 > 80);
+        gameboy.runFrame(nullptr);
     }
-    
-    // Find sprites on current scanline (max 10 per line)
-    std::array<int, 10> visible_sprites;
-    int sprite_count = 0;
-    
-    for (int i = 0; i < 40 && sprite_count < 10; i++) {
-        int sprite_y = sprites[i].y - 16;
-        
-        // Check if sprite is on this scanline
-        if (scanline >= sprite_y && scanline < sprite_y + sprite_height) {
-            visible_sprites[sprite_count++] = i;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    BenchResult result;
+    result.rom = rom_file;
+    result.timing = timing;
+    result.renderer = fifo_renderer ? "fifo" : "scanline";
+    result.instructions = gameboy.getInstructionCount();
+    result.cycles = gameboy.getTotalCycles();
+    result.seconds = std::max(seconds, 1e-9);
+    uint64_t bg_rows = gameboy.getBackgroundRowsReused() + gameboy.getBackgroundRowsDrawn();
+    result.bg_reuse = bg_rows ? (double)gameboy.getBackgroundRowsReused() / bg_rows : 0.0;
+    return result;
+}
+
+int runBenchmark(const std::vector<std::string>& rom_files, int frames, const std::string& json_file) {
+    // Both timing models and both renderers on every ROM, to weigh accuracy
+    // against speed
+    std::vector<BenchResult> results;
+    for (const std::string& rom_file : rom_files) {
+        ROMImage rom = Memory::readROMFile(rom_file);
+        if (!rom) {
+            return 1;
         }
+        results.push_back(benchmarkROM<GameBoy>(rom_file, rom, frames, "instruction"));
+        results.push_back(benchmarkROM<MCycleGameBoy>(rom_file, rom, frames, "mcycle"));
+        results.push_back(benchmarkROM<GameBoy>(rom_file, rom, frames, "instruction", true));
     }
-    
-    // ✅ DEBUG: Count total sprites found per frame
-    static int total_sprites_found = 0;
-    static int frame_counter = 0;
-    total_sprites_found += sprite_count;
-    
-    if (scanline == 143) {  // Last visible scanline
-        frame_counter++;
-        if (frame_counter % 60 == 0) {  // Once per second
-            std::cout << "Sprites found in last frame: " << total_sprites_found << std::endl;
-        }
-        total_sprites_found = 0;
+
+    long long peak_rss_kb = peakRSSKilobytes();
+
+    std::cout << "rom  timing  renderer  frames/s  instructions/s  cycles/ns  BG rows reused" << std::endl;
+    for (const BenchResult& result : results) {
+        std::cout << result.rom << "  " << result.timing << "  " << result.renderer << "  "
+                  << (long long)(frames / result.seconds) << "  "
+                  << (long long)(result.instructions / result.seconds) << "  "
+                  << result.cycles / (result.seconds * 1e9) << "  "
+                  << (int)(result.bg_reuse * 100) << "%" << std::endl;
     }
-    
-    // Draw sprites (in reverse order for priority)
-    for (int i = sprite_count - 1; i >= 0; i--) {
-        Sprite& sprite = sprites[visible_sprites[i]];
-        
-        int sprite_y = sprite.y - 16;
-        int sprite_x = sprite.x - 8;
-        
-        // Get sprite attributes
-        bool flip_y = sprite.flags & 0x40;
-        bool flip_x = sprite.flags & 0x20;
-        bool behind_bg = sprite.flags & 0x80;
-        uint8_t palette_num = (sprite.flags & 0x10) ? 1 : 0;
-        
-        // Calculate which row of the sprite we're drawing
-        int sprite_row = scanline - sprite_y;
-        if (flip_y) {
-            sprite_row = sprite_height - 1 - sprite_row;
-        }
-        
-        // Get tile data
-        uint16_t tile_addr = 0x8000 + (sprite.tile * 16) + (sprite_row * 2);
-        
-        if (sprite_height == 16) {
-            tile_addr = 0x8000 + ((sprite.tile & 0xFE) * 16) + (sprite_row * 2);
+    std::cout << "Peak RSS of the whole run: " << peak_rss_kb << " KB" << std::endl;
+
+    if (!json_file.empty()) {
+        std::ofstream json(json_file);
+        if (!json) {
+            std::cout << "Could not write " << json_file << std::endl;
+            return 1;
         }
-        
-        uint8_t byte1 = memory->read(tile_addr);
-        uint8_t byte2 = memory->read(tile_addr + 1);
-        
-        // Draw 8 pixels
-        for (int x = 0; x < 8; x++) {
-            int screen_x = sprite_x + x;
-            
-            if (screen_x < 0 || screen_x >= SCREEN_WIDTH) continue;
-            
-            int bit = flip_x ? x : (7 - x);
-            uint8_t color_num = ((byte2 >> bit) & 1) << 1 | ((byte1 >> bit) & 1);
-            
-            if (color_num == 0) continue;
-            
-            uint8_t palette = memory->read(palette_num ? 0xFF49 : 0xFF48);
-            uint8_t palette_color = (palette >> (color_num * 2)) & 0x03;
-            
-            uint32_t color;
-            switch (palette_color) {
-                case 0: color = 0xFFFFFFFF; break;
-                case 1: color = 0xFFAAAAAA; break;
-                case 2: color = 0xFF555555; break;
-                case 3: color = 0xFF000000; break;
-            }
-            
-            int fb_index = scanline * SCREEN_WIDTH + screen_x;
-            if (behind_bg) {
-                if (framebuffer[fb_index] == 0xFFFFFFFF) {
-                    framebuffer[fb_index] = color;
-                }
-            } else {
-                framebuffer[fb_index] = color;
-            }
+        json << "{\n  \"frames\": " << frames << ",\n  \"peak_rss_kb\": " << peak_rss_kb
+             << ",\n  \"results\": [\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const BenchResult& result = results[i];
+            json << "    {\"rom\": " << jsonString(result.rom)
+                 << ", \"timing\": \"" << result.timing << "\""
+                 << ", \"renderer\": \"" << result.renderer << "\""
+                 << ", \"instructions\": " << result.instructions
+                 << ", \"cycles\": " << result.cycles
+                 << ", \"seconds\": " << result.seconds
+                 << ", \"fps\": " << frames / result.seconds
+                 << ", \"instructions_per_sec\": " << result.instructions / result.seconds
+                 << ", \"cycles_per_ns\": " << result.cycles / (result.seconds * 1e9)
+                 << ", \"bg_row_reuse\": " << result.bg_reuse << "}"
+                 << (i + 1 < results.size() ? ",\n" : "\n");
         }
+        json << "  ]\n}\n";
     }
+    return 0;
 }
 
-void drawTile(int tile_num, int x, int y) {
-   uint16_t tile_addr = 0x8000 + (tile_num * 16);
-   for (int row = 0; row < 8; row++) {
-        uint8_t byte1 = memory->read(tile_addr + row * 2);
-        uint8_t byte2 = memory->read(tile_addr + row * 2 + 1);
-        for (int col = 0; col < 8; col++) {
-            int bit = 7 - col;
-            uint8_t color_num = ((byte2 >> bit) & 1) << 1 | ((byte1 >> bit) & 1);
-            uint32_t color;
-            switch (color_num) {
-                case 0: color = 0xFFFFFFFF; break; // White
-                case 1: color = 0xFFAAAAAA; break; // Light gray
-                case 2: color = 0xFF555555; break; // Dark gray
-                case 3: color = 0xFF000000; break; // Black
-            }
-            int pixel_x = x + col;
-            int pixel_y = y + row;
-            int fb_index = pixel_y * SCREEN_WIDTH + pixel_x;
-            framebuffer[fb_index] = color;
-            }
+#ifndef GB_LIBRARY
+int main(int argc, char* argv[]) {
+#ifndef GB_HEADLESS
+    // Frames to run ahead of the real one (0 = off)
+    int run_ahead_frames = 0;
+    // Rewind history budget in MB (0 = off) and keyframe spacing in frames
+    int rewind_budget_mb = 0;
+    int rewind_keyframe = 60;
+#endif
+    std::string record_file;
+    std::string replay_file;
+    // Video/audio capture files (empty = off)
+    std::string capture_video_file;
+    std::string capture_audio_file;
+    // Shared-memory segment for an external frontend (empty = off) and its RAM regions
+    std::string shm_name;
+    std::vector<SharedFrontend::Region> shm_regions;
+    int vec_bench_envs = 0;
+    // Display upscaling filter and its threads (0 = pick), or the filter benchmark
+    Upscaler::Filter filter = Upscaler::NONE;
+    int filter_threads = 0;
+    bool scaler_bench = false;
+    // Test ROM mode: every positional argument is a ROM to run
+    bool test_roms = false;
+    bool mcycle_timing = false;  // Tick the machine at every memory access
+    bool fifo_renderer = false;  // Pixel FIFO instead of whole scanlines
+    uint64_t timeout_cycles = 120ull * CPU_FREQUENCY;
+    int jobs = std::max(1u, std::thread::hardware_concurrency());
+    // Benchmark mode: frames per ROM (0 = off), optional JSON output
+    int bench_frames = 0;
+    std::string bench_json_file;
+    // Guest profiler: folded stack output (empty = off), sample interval, symbols
+    std::string profile_file;
+    int profile_interval = 1024;
+    std::string sym_file;
+    // Instruction trace ring size (0 = off), and trace file tools
+    size_t trace_entries = 0;
+    std::string trace_convert_in, trace_convert_out;
+    std::string trace_diff_a, trace_diff_b;
+    // CPU differential fuzzing: instruction streams to run (0 = off)
+    uint64_t fuzz_streams = 0;
+    // Directory of per-opcode JSON test vectors (empty = off)
+    std::string single_step_dir;
+    // Event log file (empty = off) and the categories to record
+    std::string log_file;
+    std::string log_categories = "all";
+    std::vector<std::string> rom_files;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+#ifdef GB_HEADLESS
+        if (arg == "--run-ahead" || arg == "--rewind" || arg == "--rewind-keyframe") {
+            // These only act on the windowed run
+            std::cout << arg << " needs the SDL build" << std::endl;
+            return 1;
+#else
+        if (arg == "--run-ahead" && i + 1 < argc) {
+            run_ahead_frames = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--rewind" && i + 1 < argc) {
+            rewind_budget_mb = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--rewind-keyframe" && i + 1 < argc) {
+            rewind_keyframe = std::max(1, std::atoi(argv[++i]));
+#endif
+        } else if (arg == "--record" && i + 1 < argc) {
+            record_file = argv[++i];
+        } else if (arg == "--replay" && i + 1 < argc) {
+            replay_file = argv[++i];
+        } else if (arg == "--capture-video" && i + 1 < argc) {
+            capture_video_file = argv[++i];
+        } else if (arg == "--capture-audio" && i + 1 < argc) {
+            capture_audio_file = argv[++i];
+        } else if (arg == "--shm" && i + 1 < argc) {
+            shm_name = argv[++i];
+        } else if (arg == "--shm-ram" && i + 1 < argc) {
+            if (!SharedFrontend::parseRegions(argv[++i], shm_regions)) {
+                std::cout << "--shm-ram is a comma list of up to " << SharedFrontend::MAX_REGIONS
+                          << " hex ADDRESS:LENGTH pairs (LENGTH 1-FFFF), e.g. C000:2000,FF80:7F" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--vec-bench" && i + 1 < argc) {
+            vec_bench_envs = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--filter" && i + 1 < argc) {
+            if (!Upscaler::parseFilter(argv[++i], filter)) {
+                std::cout << "--filter is none, scale2x, scale3x, hq2x, xbr or lcd" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--filter-threads" && i + 1 < argc) {
+            filter_threads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--scaler-bench") {
+            scaler_bench = true;
+        } else if (arg == "--test-roms") {
+            test_roms = true;
+        } else if (arg == "--timing" && i + 1 < argc) {
+            std::string timing = argv[++i];
+            if (timing != "mcycle" && timing != "instruction") {
+                std::cout << "--timing is mcycle or instruction" << std::endl;
+                return 1;
+            }
+            mcycle_timing = timing == "mcycle";
+        } else if (arg == "--renderer" && i + 1 < argc) {
+            std::string renderer = argv[++i];
+            if (renderer != "fifo" && renderer != "scanline") {
+                std::cout << "--renderer is fifo or scanline" << std::endl;
+                return 1;
+            }
+            fifo_renderer = renderer == "fifo";
+        } else if (arg == "--timeout-cycles" && i + 1 < argc) {
+            timeout_cycles = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--jobs" && i + 1 < argc) {
+            jobs = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--bench" && i + 1 < argc) {
+            bench_frames = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--json" && i + 1 < argc) {
+            bench_json_file = argv[++i];
+        } else if (arg == "--profile" && i + 1 < argc) {
+            profile_file = argv[++i];
+        } else if (arg == "--profile-interval" && i + 1 < argc) {
+            profile_interval = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--sym" && i + 1 < argc) {
+            sym_file = argv[++i];
+        } else if (arg == "--trace" && i + 1 < argc) {
+            trace_entries = (size_t)std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--trace-to-doctor" && i + 2 < argc) {
+            trace_convert_in = argv[++i];
+            trace_convert_out = argv[++i];
+        } else if (arg == "--single-step" && i + 1 < argc) {
+            single_step_dir = argv[++i];
+        } else if (arg == "--fuzz" && i + 1 < argc) {
+            fuzz_streams = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--trace-diff" && i + 2 < argc) {
+            trace_diff_a = argv[++i];
+            trace_diff_b = argv[++i];
+        } else if (arg == "--log" && i + 1 < argc) {
+            log_file = argv[++i];
+        } else if (arg == "--log-categories" && i + 1 < argc) {
+            log_categories = argv[++i];
+        } else if (arg.compare(0, 2, "--") != 0) {
+            rom_files.push_back(arg);
+        } else {
+            std::cout << "Unknown option: " << arg << std::endl;
+            return 1;
         }
-   }
-    
-    const std::array<uint32_t, SCREEN_WIDTH * SCREEN_HEIGHT>& getFramebuffer() {
-        return framebuffer;
     }
-};
 
-class GameBoy {
-private:
-    Memory memory;
-    CPU cpu;
-    PPU ppu;
-    Timer timer;
-    APU apu;
-    std::array<bool, 8> button_states;
-    
-public:
-    GameBoy() : cpu(&memory), ppu(&memory), timer(&memory), apu(&memory) {
-        button_states.fill(false);
-        memory.setAPU(&apu);
+    if (!log_file.empty()) {
+        uint32_t categories = Logger::parseCategories(log_categories);
+        if (!categories) {
+            std::cout << "--log-categories is \"all\" or a comma list of mbc, dma, ppu, cpu, interrupt, oam, serial" << std::endl;
+            return 1;
+        }
+        if ((categories & GB_LOG) == 0) {
+            std::cout << "None of these log categories are compiled in, rebuild with -DGB_LOG=0x7F (or a narrower mask)" << std::endl;
+            return 1;
+        }
+        if (!Logger::get().start(log_file, categories)) {
+            return 1;
+        }
     }
-    
-    bool loadROM(const std::string& filename) {
-        return memory.loadROM(filename);
+
+    // Fuzzing and trace tools need no ROM
+    if (fuzz_streams > 0) {
+        return runCPUFuzzer(fuzz_streams, jobs);
     }
-    
-    int step() {
-        int cycles = cpu.step();
-        ppu.step(cycles);
-        timer.step(cycles);
-        apu.step(cycles);
-        return cycles;
+    if (!single_step_dir.empty()) {
+        return runSingleStepTests(single_step_dir, jobs);
     }
-    
-    const std::array<uint32_t, SCREEN_WIDTH * SCREEN_HEIGHT>& getScreen() {
-        return ppu.getFramebuffer();
+    if (!trace_convert_in.empty()) {
+        return convertTrace(trace_convert_in, trace_convert_out);
     }
-
-    float getAudioSample() {
-        return apu.generateSample();
+    if (!trace_diff_a.empty()) {
+        return diffTraces(trace_diff_a, trace_diff_b);
     }
 
-    void setButtonState(int button, bool pressed) {
-        if (pressed && !button_states[button]) {
-            // Button just pressed
-            if (button < 4) {
-                memory.pressButton(button);
-            } else {
-                memory.pressDirection(button - 4);
-            }
-            button_states[button] = true;
-        } else if (!pressed && button_states[button]) {
-            // Button just released
-            if (button < 4) {
-                memory.releaseButton(button);
-            } else {
-                memory.releaseDirection(button - 4);
-            }
-            button_states[button] = false;
+    // The benchmark defaults to the ROMs that ship with the repo
+    if (bench_frames > 0) {
+        if (rom_files.empty()) {
+            rom_files = {"tetris.gb", "tennis.gb", "pokemonRed.gb", "cpu_instrs.gb"};
         }
+        return runBenchmark(rom_files, bench_frames, bench_json_file);
     }
 
-};
-
-
+    if (rom_files.empty() || (!test_roms && rom_files.size() > 1)) {
+        std::cout << "Usage: " << argv[0] << " <ROM file> [--run-ahead N] [--rewind MB] [--rewind-keyframe N]"
+                  << " [--record movie.gbm | --replay movie.gbm] [--vec-bench MAX_ENVS]"
+                  << " [--profile out.folded] [--profile-interval CYCLES] [--sym game.sym] [--trace N]"
+                  << " [--log out.log] [--log-categories LIST] [--renderer fifo|scanline]"
+                  << " [--filter scale2x|scale3x|hq2x|xbr|lcd] [--filter-threads N]"
+                  << " [--capture-video out.y4m] [--capture-audio out.wav]" << std::endl;
+        std::cout << "       " << argv[0] << " --shm NAME <ROM file> [--shm-ram ADDR:LEN,...] [--renderer fifo|scanline]" << std::endl;
+        std::cout << "       " << argv[0] << " --scaler-bench <ROM file> [--filter-threads MAX]" << std::endl;
+        std::cout << "       " << argv[0] << " --test-roms <ROM file>... [--timeout-cycles N] [--jobs J] [--trace N] [--timing mcycle|instruction]"
+                  << " [--renderer fifo|scanline]" << std::endl;
+        std::cout << "       " << argv[0] << " --bench FRAMES [ROM file...] [--json results.json]" << std::endl;
+        std::cout << "       " << argv[0] << " --trace-to-doctor trace.gbtr out.log | --trace-diff a b" << std::endl;
+        std::cout << "       " << argv[0] << " --fuzz STREAMS [--jobs J]" << std::endl;
+        std::cout << "       " << argv[0] << " --single-step TEST_DIR [--jobs J]" << std::endl;
+        return 1;
+    }
+    const std::string& rom_file = rom_files[0];
 
-// SDL Display
-class Display {
-private:
-    SDL_Window* window;
-    SDL_Renderer* renderer;
-    SDL_Texture* texture;
-    
-public:
-    Display() {
-        
-        window = SDL_CreateWindow(
-            "Game Boy Emulator",
-            SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-            SCREEN_WIDTH * SCALE, SCREEN_HEIGHT * SCALE,
-            SDL_WINDOW_SHOWN
-        );
-        
-        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-        
-        texture = SDL_CreateTexture(
-            renderer,
-            SDL_PIXELFORMAT_ARGB8888,
-            SDL_TEXTUREACCESS_STREAMING,
-            SCREEN_WIDTH, SCREEN_HEIGHT
-        );
+    // Replays and test runs never open a window
+    if (test_roms) {
+        if (mcycle_timing) {
+            return runTestROMs<MCycleGameBoy>(rom_files, timeout_cycles, jobs, trace_entries, fifo_renderer);
+        }
+        return runTestROMs<GameBoy>(rom_files, timeout_cycles, jobs, trace_entries, fifo_renderer);
     }
-    
-    ~Display() {
-        SDL_DestroyTexture(texture);
-        SDL_DestroyRenderer(renderer);
-        SDL_DestroyWindow(window);
+    SymbolTable symbols;
+    if (!sym_file.empty() && !symbols.load(sym_file)) {
+        return 1;
     }
-    
-    void render(const std::array<uint32_t, SCREEN_WIDTH * SCREEN_HEIGHT>& pixels) {
-        SDL_UpdateTexture(texture, nullptr, pixels.data(), SCREEN_WIDTH * sizeof(uint32_t));
-        SDL_RenderClear(renderer);
-        SDL_RenderCopy(renderer, texture, nullptr, nullptr);
-        SDL_RenderPresent(renderer);
+    GuestProfiler profiler(profile_interval);
+    GuestProfiler* active_profiler = profile_file.empty() ? nullptr : &profiler;
+
+    CaptureSink capture;
+    CaptureSink* active_capture = nullptr;
+    if (!capture_video_file.empty() || !capture_audio_file.empty()) {
+        if (!capture.open(capture_video_file, capture_audio_file)) {
+            return 1;
+        }
+        active_capture = &capture;
     }
-};
+    auto report_capture = [&]() {
+        if (active_capture) {
+            capture.close();
+            std::cout << "Capture: " << capture.framesWritten() << " frames written, "
+                      << capture.framesDropped() << " dropped (previous frame repeated)" << std::endl;
+        }
+    };
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        std::cout << "Usage: " << argv[0] << " <ROM file>" << std::endl;
-        return 1;
+    if (!replay_file.empty()) {
+        int result = replayMovie(rom_file, replay_file, active_profiler, active_capture);
+        report_capture();
+        if (active_profiler && profiler.writeFolded(profile_file, symbols)) {
+            profiler.printTop(20, symbols);
+        }
+        return result;
+    }
+    if (!shm_name.empty()) {
+        return runSharedFrontend(rom_file, shm_name, shm_regions, fifo_renderer);
+    }
+    if (vec_bench_envs > 0) {
+        return runVecBenchmark(rom_file, vec_bench_envs);
+    }
+    if (scaler_bench) {
+        return runScalerBenchmark(rom_file, filter_threads > 0 ? filter_threads
+                                                               : std::max(1u, std::thread::hardware_concurrency()));
     }
 
+#ifdef GB_HEADLESS
+    std::cout << "Built without SDL, only the headless modes (--replay, --shm, --vec-bench, --scaler-bench, --test-roms, --bench, --fuzz, --single-step) are available" << std::endl;
+    return 1;
+#else
+
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
         std::cout << "SDL could not initialize! SDL_Error: " << SDL_GetError() << std::endl;
         return 1;
@@ -4837,12 +10532,40 @@ int main(int argc, char* argv[]) {
     Uint32 frame_start_time = SDL_GetTicks();
     
     GameBoy gameboy;
-    Display display;
+    Display display(filter, filter_threads);
     
-    if (!gameboy.loadROM(argv[1])) {
+    if (!gameboy.loadROM(rom_file)) {
         return 1;
     }
 
+    // Serial output goes to a log; stop once a test ROM reports its result
+    SerialTestMatcher test_matcher;
+    SerialLogSink serial_log("serial_log.txt", &test_matcher);
+    gameboy.setSerialSink(&serial_log);
+    gameboy.setGuestProfiler(active_profiler);
+    gameboy.setFifoRenderer(fifo_renderer);
+
+    // F9 dumps the recent instructions, a lock-up dumps them automatically
+    std::unique_ptr<TraceRing> trace;
+    if (trace_entries > 0) {
+        trace.reset(new TraceRing(trace_entries));
+        gameboy.setTrace(trace.get());
+    }
+
+    Movie movie;
+    if (!record_file.empty()) {
+        movie.rom_hash = gameboy.romHash();
+        movie.fifo_renderer = fifo_renderer;
+        gameboy.setRecording(&movie);
+        if (run_ahead_frames > 0) {
+            // Recorded hashes must be of the real frames, not the look-ahead ones
+            std::cout << "Run-ahead is disabled while recording" << std::endl;
+            run_ahead_frames = 0;
+        }
+    }
+    // Scaling a frame behind would give back the frame run-ahead saves
+    display.setPipelined(run_ahead_frames == 0);
+
     SDL_AudioSpec want, have;
     SDL_zero(want);
     want.freq = 44100;
@@ -4863,7 +10586,15 @@ int main(int argc, char* argv[]) {
     std::vector<float> audio_buffer;
     audio_buffer.reserve(1024);
     
+    // Scratch snapshot for run-ahead, reused every frame
+    GameBoy::Snapshot run_ahead_state;
+
+    // Hold Backspace to rewind
+    RewindBuffer rewind((size_t)rewind_budget_mb * 1024 * 1024, rewind_keyframe);
+    bool rewinding = false;
+    
     bool running = true;
+    int exit_code = 0;
     SDL_Event event;
     
     while (running) {
@@ -4882,6 +10613,8 @@ int main(int argc, char* argv[]) {
                     case SDLK_DOWN: gameboy.setButtonState(Memory::DIR_DOWN + 4, true); break;
                     case SDLK_LEFT: gameboy.setButtonState(Memory::DIR_LEFT + 4, true); break;
                     case SDLK_RIGHT: gameboy.setButtonState(Memory::DIR_RIGHT + 4, true); break;
+                    case SDLK_BACKSPACE: rewinding = rewind_budget_mb > 0; break;
+                    case SDLK_F9: if (trace) trace->dump("trace.gbtr"); break;
                 }
             }
             
@@ -4896,34 +10629,60 @@ int main(int argc, char* argv[]) {
                     case SDLK_DOWN: gameboy.setButtonState(Memory::DIR_DOWN + 4, false); break;
                     case SDLK_LEFT: gameboy.setButtonState(Memory::DIR_LEFT + 4, false); break;
                     case SDLK_RIGHT: gameboy.setButtonState(Memory::DIR_RIGHT + 4, false); break;
+                    case SDLK_BACKSPACE: rewinding = false; break;
                 }
             }
         }
         
         // ✅ Remove the updateButtonStates() call - we handle it manually now
         
-    int cycles_this_frame = 0;
-    static int audio_cycles = 0;  // ✅ Move outside the loop
-
-    while (cycles_this_frame < 70224) {
-        int cycles = gameboy.step();  // ✅ Call once
-        cycles_this_frame += cycles;
-        audio_cycles += cycles;
-    
-    // Generate audio sample every ~95 cycles (44100 Hz from 4.194 MHz)
-        while (audio_cycles >= 95) {
-            audio_cycles -= 95;
-            audio_buffer.push_back(gameboy.getAudioSample());
+        if (rewinding) {
+            // One frame back per displayed frame, silent
+            rewind.rewind(gameboy);
+            if (active_profiler) {
+                active_profiler->resetStack();
+            }
+            if (!record_file.empty()) {
+                movie.truncate(gameboy.getFrameCount());
+            }
+        } else {
+            if (run_ahead_frames > 0) {
+                gameboy.runFrameAhead(run_ahead_frames, run_ahead_state, &audio_buffer);
+            } else {
+                gameboy.runFrame(&audio_buffer);
+            }
+            if (rewind_budget_mb > 0) {
+                rewind.push(gameboy);
+            }
+            if (!record_file.empty()) {
+                movie.addFrame(gameboy.getScreenHash());
+            }
+            if (active_capture) {
+                capture.push(gameboy.getScreen().data(), audio_buffer);
+            }
         }
-}
 
         if (!audio_buffer.empty()) {
             SDL_QueueAudio(audio_device, audio_buffer.data(), audio_buffer.size() * sizeof(float));
             audio_buffer.clear();
         }
 
-        display.render(gameboy.getScreen());
-        display.render(gameboy.getScreen());
+        display.render(gameboy.getScreen(), gameboy.getScreenHash());
+
+        if (test_matcher.getResult() != SerialTestMatcher::RUNNING) {
+            bool passed = test_matcher.getResult() == SerialTestMatcher::PASSED;
+            std::cout << (passed ? "\n\n=== TEST PASSED ===" : "\n\n=== TEST FAILED ===") << std::endl;
+            exit_code = passed ? 0 : 1;
+            running = false;
+        } else if (gameboy.isCPULocked()) {
+            std::cout << "CPU locked up on opcode 0x" << std::hex << (int)gameboy.readMemory(gameboy.getPC())
+                      << " at PC 0x" << gameboy.getPC() << std::dec << ", stopping" << std::endl;
+            if (trace) {
+                trace->dump("trace_crash.gbtr");
+            }
+            exit_code = 1;
+            running = false;
+        }
 
         Uint32 frame_end_time = SDL_GetTicks();
         float frame_duration = frame_end_time - frame_start_time;
@@ -4932,10 +10691,29 @@ int main(int argc, char* argv[]) {
         }
         frame_start_time = SDL_GetTicks();
     }
+    if (!record_file.empty() && movie.save(record_file)) {
+        std::cout << "Recorded " << movie.frame_hashes.size() << " frames, "
+                  << movie.events.size() << " inputs to " << record_file << std::endl;
+    }
+
+    if (active_profiler && profiler.writeFolded(profile_file, symbols)) {
+        profiler.printTop(20, symbols);
+    }
+
+    if (rewind_budget_mb > 0) {
+        std::cout << "Rewind: " << rewind.frameCount() << " frames buffered in "
+                  << rewind.usedBytes() / 1024 << " KB, "
+                  << (int)rewind.averageBytesPerFrame() << " bytes/frame" << std::endl;
+    }
+
+    report_capture();
+
     SDL_CloseAudioDevice(audio_device);
     SDL_Quit();
-    return 0;
+    return exit_code;
+#endif // GB_HEADLESS
 }
+#endif // GB_LIBRARY
 
 
 /*